@@ -0,0 +1,234 @@
+/*=============================================================================
+
+  p53-fan
+  bench.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Measure the sensor scan and fan control paths against a synthetic tree 
+  made by bench/mkfixture.sh. Build with "make bench". For each way of 
+  reading the sensors, we report the time per scan, and the number of 
+  system calls and heap allocations per scan. 
+
+  The counts come from wrapping the library calls that the p53-fan code 
+  makes (see BENCH_WRAP in the Makefile), so they don't include anything
+  that the C library does internally. In particular, opendir() counts as
+  one system call and one allocation, and readdir() as one system call.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "../src/defs.h"
+#include "../src/mylog.h"
+#include "../src/stats.h"
+#include "../src/fan.h"
+#include "../src/hwmon_scan.h"
+
+static unsigned long syscalls;
+static unsigned long allocs;
+
+#define COUNT_SYSCALL(ret, name, params, args) \
+  extern ret __real_##name params; \
+  ret __wrap_##name params { syscalls++; return __real_##name args; }
+
+COUNT_SYSCALL (int, close, (int fd), (fd))
+COUNT_SYSCALL (ssize_t, read, (int fd, void *b, size_t n), (fd, b, n))
+COUNT_SYSCALL (ssize_t, write, (int fd, const void *b, size_t n), (fd, b, n))
+COUNT_SYSCALL (ssize_t, pread, (int fd, void *b, size_t n, off_t o), 
+  (fd, b, n, o))
+COUNT_SYSCALL (int, dup, (int fd), (fd))
+COUNT_SYSCALL (int, fstatat, (int d, const char *p, struct stat *s, int f), 
+  (d, p, s, f))
+COUNT_SYSCALL (ssize_t, readlinkat, (int d, const char *p, char *b, size_t n), 
+  (d, p, b, n))
+COUNT_SYSCALL (struct dirent *, readdir, (DIR *d), (d))
+COUNT_SYSCALL (int, closedir, (DIR *d), (d))
+
+extern int __real_open (const char *path, int flags, ...);
+int __wrap_open (const char *path, int flags, ...)
+  {
+  va_list ap;
+  va_start (ap, flags);
+  int mode = va_arg (ap, int);
+  va_end (ap);
+  syscalls++;
+  return __real_open (path, flags, mode);
+  }
+
+extern int __real_openat (int dirfd, const char *path, int flags, ...);
+int __wrap_openat (int dirfd, const char *path, int flags, ...)
+  {
+  va_list ap;
+  va_start (ap, flags);
+  int mode = va_arg (ap, int);
+  va_end (ap);
+  syscalls++;
+  return __real_openat (dirfd, path, flags, mode);
+  }
+
+extern long __real_syscall (long number, ...);
+long __wrap_syscall (long number, ...)
+  {
+  va_list ap;
+  va_start (ap, number);
+  long a[6];
+  for (int i = 0; i < 6; i++) a[i] = va_arg (ap, long);
+  va_end (ap);
+  syscalls++;
+  return __real_syscall (number, a[0], a[1], a[2], a[3], a[4], a[5]);
+  }
+
+extern DIR *__real_opendir (const char *path);
+DIR *__wrap_opendir (const char *path)
+  {
+  syscalls++;
+  allocs++;
+  return __real_opendir (path);
+  }
+
+extern DIR *__real_fdopendir (int fd);
+DIR *__wrap_fdopendir (int fd)
+  {
+  allocs++;
+  return __real_fdopendir (fd);
+  }
+
+extern void *__real_malloc (size_t n);
+void *__wrap_malloc (size_t n) { allocs++; return __real_malloc (n); }
+extern void *__real_calloc (size_t n, size_t size);
+void *__wrap_calloc (size_t n, size_t size) 
+  { allocs++; return __real_calloc (n, size); }
+extern void *__real_realloc (void *p, size_t n);
+void *__wrap_realloc (void *p, size_t n) 
+  { allocs++; return __real_realloc (p, n); }
+
+/**
+  report
+
+  Print a line for one measurement: latency, and syscalls and allocations
+per call.
+*/
+static void report (const char *name, const Histogram *h, unsigned long calls,
+         unsigned long syscalls, unsigned long allocs)
+  {
+  char buff[256];
+  histogram_format (h, name, buff, sizeof (buff));
+  printf ("%s\n    %.1f syscalls, %.1f allocations per call\n", buff, 
+    (double)syscalls / calls, (double)allocs / calls);
+  }
+
+/**
+  bench_scan
+
+  Time a cold discovery, then the specified number of polls. We tell the 
+scanner that hotplug events are available, so the polls don't include its
+periodic rediscovery. Returns -1 if the backend isn't available.
+*/
+static int bench_scan (const char *root, BOOL uring, int polls)
+  {
+  const char *name = uring ? "io_uring" : "pread";
+  HSContext context;
+  hwmon_init (&context, root);
+  context.hotplug = TRUE;
+  if (uring && hwmon_use_uring (&context) != 0)
+    {
+    hwmon_done (&context);
+    return -1;
+    }
+
+  Histogram h = {0};
+  syscalls = allocs = 0;
+  uint64_t start = stats_now ();
+  hwmon_scan (&context, FALSE, FALSE);
+  histogram_add (&h, stats_now () - start);
+  printf ("%s: %d sensors on %d devices\n", name, context.nsensors, 
+    context.ndevices);
+  report ("  discovery", &h, 1, syscalls, allocs);
+
+  memset (&h, 0, sizeof (h));
+  syscalls = allocs = 0;
+  for (int i = 0; i < polls; i++)
+    {
+    start = stats_now ();
+    hwmon_scan (&context, FALSE, FALSE);
+    histogram_add (&h, stats_now () - start);
+    }
+  report ("  scan", &h, polls, syscalls, allocs);
+  hwmon_done (&context);
+  return 0;
+  }
+
+/**
+  bench_fan
+
+  Time fan_set_level(), alternating between two levels so every call writes.
+Then check that the fan file reads back the level written, and that setting
+the same level again makes no writes and isn't taken for tampering. Returns
+-1 if either check fails.
+*/
+static int bench_fan (const char *fan_file, int calls)
+  {
+  fan_set_file (fan_file);
+  if (fan_to_manual (FALSE) != 0) return -1;
+  Histogram h = {0};
+  syscalls = allocs = 0;
+  for (int i = 0; i < calls; i++)
+    {
+    uint64_t start = stats_now ();
+    fan_set_level (2 + i % 2, FALSE);
+    histogram_add (&h, stats_now () - start);
+    }
+  report ("fan_set_level", &h, calls, syscalls, allocs);
+
+  int ret = 0;
+  fan_set_level (5, FALSE);
+  if (fan_get_level () != 5)
+    {
+    printf ("FAILED: fan level reads back as %d, not 5\n", fan_get_level ());
+    ret = -1;
+    }
+  FanStats before, after;
+  fan_get_stats (&before);
+  for (int i = 0; i < calls; i++)
+    fan_set_level (5, FALSE);
+  fan_get_stats (&after);
+  printf ("fan_set_level unchanged: %u writes, %u tampers in %d calls\n", 
+    after.writes - before.writes, after.tampers - before.tampers, calls);
+  if (after.writes != before.writes || after.tampers != before.tampers)
+    {
+    printf ("FAILED: an unchanged level should make no writes\n");
+    ret = -1;
+    }
+  fan_to_auto (FALSE);
+  return ret;
+  }
+
+/**
+  main
+*/
+int main (int argc, char **argv)
+  {
+  if (argc < 2)
+    {
+    fprintf (stderr, "Usage: %s FIXTURE_DIR [POLLS]\n", argv[0]);
+    return 1;
+    }
+  int polls = argc > 2 ? atoi (argv[2]) : 1000;
+  if (polls <= 0) polls = 1000;
+  mylog_level = MYLOG_ERROR;
+
+  char root[PATH_MAX], fan_file[PATH_MAX];
+  snprintf (root, sizeof (root), "%s/hwmon", argv[1]);
+  snprintf (fan_file, sizeof (fan_file), "%s/fan", argv[1]);
+
+  bench_scan (root, FALSE, polls);
+  if (bench_scan (root, TRUE, polls) != 0)
+    printf ("io_uring: not available\n");
+  return bench_fan (fan_file, polls) == 0 ? 0 : 1;
+  }
@@ -0,0 +1,120 @@
+#!/bin/sh
+# Build a synthetic hwmon tree and fan control file, for benchmarking and
+#   testing p53-fan on machines that aren't ThinkPads. The tree goes in
+#   DIR/hwmon and the fan file is DIR/fan, so:
+#
+#   p53-fan -f --hwmon-root DIR/hwmon --fan-file DIR/fan
+#
+# Usage: mkfixture.sh [options] DIR
+#   -p N   coretemp packages (1)
+#   -c N   cores per coretemp package (32)
+#   -n N   NVMe drives, with Composite and two other sensors each (4)
+#   -s N   SATA drives using drivetemp, which has no labels (2)
+#   -w N   iwlwifi adapters, which have no labels (1)
+#   -u N   other devices with unlabelled sensors, like acpitz (2)
+#   -t     include thinkpad_acpi, with CPU and GPU labels, and two fans (off)
+
+PACKAGES=1
+CORES=32
+NVME=4
+SATA=2
+WIFI=1
+OTHER=2
+THINKPAD=0
+
+while getopts "p:c:n:s:w:u:th" opt; do
+  case $opt in
+    p) PACKAGES=$OPTARG ;;
+    c) CORES=$OPTARG ;;
+    n) NVME=$OPTARG ;;
+    s) SATA=$OPTARG ;;
+    w) WIFI=$OPTARG ;;
+    u) OTHER=$OPTARG ;;
+    t) THINKPAD=1 ;;
+    h) sed -n '8,15s/^# //p' "$0"; exit 0 ;;
+    *) sed -n '8,15s/^# //p' "$0"; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+DIR=${1:?usage: mkfixture.sh [options] DIR}
+
+HWMON="$DIR/hwmon"
+rm -rf "$HWMON" "$DIR/fan"
+mkdir -p "$HWMON"
+N=0
+SENSORS=0
+
+# new_device DRIVER -- creates the next hwmonN directory and sets DEV
+new_device () {
+  DEV="$HWMON/hwmon$N"
+  mkdir -p "$DEV"
+  echo "$1" > "$DEV/name"
+  N=$((N + 1))
+}
+
+# new_sensor INDEX MILLIDEGREES [LABEL]
+new_sensor () {
+  echo "$2" > "$DEV/temp$1_input"
+  [ -n "$3" ] && echo "$3" > "$DEV/temp$1_label"
+  SENSORS=$((SENSORS + 1))
+}
+
+i=0
+while [ $i -lt $PACKAGES ]; do
+  new_device coretemp
+  new_sensor 1 55000 "Package id $i"
+  c=0
+  while [ $c -lt $CORES ]; do
+    new_sensor $((c + 2)) $(( (40 + c % 20) * 1000 )) "Core $c"
+    c=$((c + 1))
+  done
+  i=$((i + 1))
+done
+
+i=0
+while [ $i -lt $NVME ]; do
+  new_device nvme
+  new_sensor 1 $(( (45 + i) * 1000 )) Composite
+  new_sensor 2 $(( (47 + i) * 1000 )) "Sensor 1"
+  new_sensor 3 $(( (43 + i) * 1000 )) "Sensor 2"
+  i=$((i + 1))
+done
+
+i=0
+while [ $i -lt $SATA ]; do
+  new_device drivetemp
+  new_sensor 1 $(( (35 + i) * 1000 ))
+  i=$((i + 1))
+done
+
+i=0
+while [ $i -lt $WIFI ]; do
+  new_device iwlwifi_1
+  new_sensor 1 48000
+  i=$((i + 1))
+done
+
+i=0
+while [ $i -lt $OTHER ]; do
+  new_device acpitz
+  new_sensor 1 $(( (30 + i) * 1000 ))
+  new_sensor 2 $(( (32 + i) * 1000 ))
+  i=$((i + 1))
+done
+
+if [ $THINKPAD = 1 ]; then
+  new_device thinkpad
+  new_sensor 1 52000 CPU
+  new_sensor 2 50000 GPU
+  j=3
+  while [ $j -le 8 ]; do
+    new_sensor $j 38000
+    j=$((j + 1))
+  done
+  # Two fans, like the P53's
+  echo 2000 > "$DEV/fan1_input"
+  echo 2100 > "$DEV/fan2_input"
+fi
+
+printf 'status:\t\tenabled\nspeed:\t\t2000\nlevel:\t\tauto\n' > "$DIR/fan"
+echo "Created $SENSORS sensors on $N hwmon devices in $HWMON, and $DIR/fan"
@@ -0,0 +1,207 @@
+/*=============================================================================
+
+  p53-fan
+  actuator.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  The actuator thread, which is the only thing that writes the fan level
+  once the main loop is running. An EC write can take tens of 
+  milliseconds when the embedded controller is busy, and that mustn't 
+  delay the next poll. So the main loop just posts the level it has chosen
+  into a mailbox, and the actuator thread picks it up and writes it.
+
+  The mailbox is a single 64-bit word, updated with atomic exchanges, so 
+  neither side ever waits for the other. It holds only the latest level: 
+  if the main loop posts twice while the EC is busy, the first level is 
+  simply replaced, since there's no point in setting it. An eventfd wakes
+  the actuator thread when there's something in the mailbox.
+
+  Between levels, the actuator thread checks the fan speeds (see rpm.c), 
+  and runs the fans higher than asked for if any of them is failing.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "defs.h"
+#include "mylog.h"
+#include "fan.h"
+#include "stats.h"
+#include "rpm.h"
+#include "actuator.h"
+
+// Mailbox values other than a level. A level L is posted as L + 1.
+#define MAILBOX_EMPTY 0
+#define MAILBOX_QUIT UINT64_MAX
+
+static uint64_t mailbox = MAILBOX_EMPTY;
+static int event_fd = -1;
+static pthread_t thread;
+static BOOL running = FALSE;
+static BOOL actuator_dry_run = FALSE;
+static Histogram *actuator_time = NULL;
+// Fan speed feedback, which the main loop can read under the lock
+static Rpm rpm;
+static pthread_mutex_t rpm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+  set_level
+
+  Write a level to the fan, timing the write when statistics are enabled.
+*/
+static void set_level (int level)
+  {
+  uint64_t t0 = stats_enabled ? stats_now () : 0;
+  fan_set_level (level, actuator_dry_run);
+  if (stats_enabled && actuator_time) 
+    histogram_add (actuator_time, stats_now () - t0);
+  }
+
+/**
+  apply_level
+
+  Write the level the main loop asked for, or a higher one if the fan is 
+failing.
+*/
+static void apply_level (int level)
+  {
+  pthread_mutex_lock (&rpm_lock);
+  int actual = rpm_escalate (&rpm, level);
+  pthread_mutex_unlock (&rpm_lock);
+  set_level (actual);
+  pthread_mutex_lock (&rpm_lock);
+  rpm_written (&rpm, actual, stats_now ());
+  pthread_mutex_unlock (&rpm_lock);
+  }
+
+/**
+  actuator_thread
+
+  Wait for the mailbox to be filled, and write whatever level is in it,
+until told to quit. In between, check the fan speed when it's due.
+*/
+static void *actuator_thread (void *arg)
+  {
+  int asked = -1; // The level the main loop last asked for
+  struct pollfd pfd;
+  pfd.fd = event_fd;
+  pfd.events = POLLIN;
+  while (1)
+    {
+    int n = poll (&pfd, 1, rpm_timeout_ms (&rpm, stats_now ()));
+    if (n < 0 && errno != EINTR)
+      {
+      mylog_error ("Actuator can't wait for events: %s", strerror (errno));
+      break;
+      }
+    if (n > 0)
+      {
+      uint64_t count;
+      read (event_fd, &count, sizeof (count));
+      uint64_t v = __atomic_exchange_n (&mailbox, MAILBOX_EMPTY, 
+        __ATOMIC_ACQUIRE);
+      if (v == MAILBOX_QUIT) break;
+      if (v != MAILBOX_EMPTY) 
+        {
+        asked = (int)(v - 1);
+        apply_level (asked);
+        }
+      }
+    if (asked >= 0 && rpm_timeout_ms (&rpm, stats_now ()) == 0)
+      {
+      // Reading the speeds is an EC transaction, like writing the level
+      int speeds[FAN_SPEEDS_MAX];
+      int nfans = fan_get_speeds (speeds);
+      pthread_mutex_lock (&rpm_lock);
+      BOOL changed = rpm_check (&rpm, speeds, nfans, stats_now ());
+      pthread_mutex_unlock (&rpm_lock);
+      if (changed) apply_level (asked);
+      }
+    }
+  return NULL;
+  }
+
+/**
+  actuator_start
+
+  Start the actuator thread. fan_time, if not NULL, collects the time taken
+by each fan write. If the thread can't be started, actuator_post() writes 
+the fan level itself, as before. Returns 0 if the thread is running.
+*/
+int actuator_start (BOOL dry_run, Histogram *fan_time)
+  {
+  actuator_dry_run = dry_run;
+  actuator_time = fan_time;
+  event_fd = eventfd (0, EFD_CLOEXEC);
+  if (event_fd < 0)
+    {
+    mylog_warn ("Can't create actuator event: %s", strerror (errno));
+    return -1;
+    }
+  __atomic_store_n (&mailbox, MAILBOX_EMPTY, __ATOMIC_RELAXED);
+  rpm_init (&rpm);
+  int ret = pthread_create (&thread, NULL, actuator_thread, NULL);
+  if (ret != 0)
+    {
+    mylog_warn ("Can't start actuator thread: %s", strerror (ret));
+    close (event_fd);
+    event_fd = -1;
+    return -1;
+    }
+  running = TRUE;
+  return 0;
+  }
+
+/**
+  actuator_post
+
+  Ask for the fan to be set to level. This doesn't wait for the write. 
+*/
+void actuator_post (int level)
+  {
+  if (!running)
+    {
+    set_level (level);
+    return;
+    }
+  __atomic_store_n (&mailbox, (uint64_t)level + 1, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  write (event_fd, &one, sizeof (one));
+  }
+
+/**
+  actuator_stop
+
+  Stop the actuator thread, and wait for any write in progress to finish, 
+so that nothing changes the fan level after this returns. A level still in
+the mailbox is abandoned.
+*/
+void actuator_stop (void)
+  {
+  if (!running) return;
+  __atomic_store_n (&mailbox, MAILBOX_QUIT, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  write (event_fd, &one, sizeof (one));
+  pthread_join (thread, NULL);
+  close (event_fd);
+  event_fd = -1;
+  running = FALSE;
+  }
+
+/**
+  actuator_get_rpm
+
+  Get a copy of the fan speed statistics.
+*/
+void actuator_get_rpm (Rpm *copy)
+  {
+  pthread_mutex_lock (&rpm_lock);
+  *copy = rpm;
+  pthread_mutex_unlock (&rpm_lock);
+  }
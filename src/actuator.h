@@ -0,0 +1,18 @@
+/*=============================================================================
+
+  p53-fan
+  actuator.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+#include "stats.h"
+#include "rpm.h"
+
+extern int actuator_start (BOOL dry_run, Histogram *fan_time);
+extern void actuator_post (int level);
+extern void actuator_stop (void);
+extern void actuator_get_rpm (Rpm *copy);
@@ -0,0 +1,100 @@
+/*=============================================================================
+
+  p53-fan
+  adaptive.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "defs.h"
+#include "mylog.h"
+#include "adaptive.h"
+
+// Weight of the newest sample in the smoothed slope
+#define ADAPTIVE_ALPHA 0.4
+// A slope (C/sec) above which we consider the temperature to be rising
+#define ADAPTIVE_RISING 0.2
+// A slope (C/sec) below which we consider the temperature to be flat
+#define ADAPTIVE_FLAT 0.02
+// Within this many degrees of the next fan level up, we poll at the floor rate
+#define ADAPTIVE_NEAR 1
+// We only stretch the interval when at least this far from the next level up
+#define ADAPTIVE_FAR 3
+// When rising, try to get at least this many polls before the next boundary
+#define ADAPTIVE_POLLS_TO_BOUNDARY 3
+
+/**
+  adaptive_init
+  Set up the scheduler, with the interval between min_ms and max_ms,
+starting at start_ms.
+*/
+void adaptive_init (Adaptive *adaptive, int min_ms, int max_ms, int start_ms)
+  {
+  adaptive->min_ms = min_ms;
+  adaptive->max_ms = max_ms;
+  if (start_ms < min_ms) start_ms = min_ms;
+  if (start_ms > max_ms) start_ms = max_ms;
+  adaptive->interval_ms = start_ms;
+  adaptive->slope = 0;
+  adaptive->have_last = FALSE;
+  }
+
+/**
+  adaptive_next
+  Work out the interval until the next poll, given the temperature just read
+at time now (seconds, monotonic). range_min and range_max are the limits of
+the fan curve's range for the current level: if the temperature reaches
+range_max, or falls below range_min, the fan level will change. We only
+really care about range_max, since being late to turn the fan down is 
+harmless.
+
+  The interval shrinks quickly -- it's halved, or cut to give several polls
+before the temperature is expected to reach the next boundary -- when the
+temperature is rising or close to the next level up. It grows slowly, by half
+as much again, only when the temperature is flat and well clear of that
+boundary. Otherwise it stays where it is.
+*/
+int adaptive_next (Adaptive *adaptive, double now, int temp, int range_min,
+       int range_max)
+  {
+  if (adaptive->have_last && now > adaptive->last_time)
+    {
+    double slope = (temp - adaptive->last_temp) 
+      / (now - adaptive->last_time);
+    adaptive->slope = ADAPTIVE_ALPHA * slope 
+      + (1 - ADAPTIVE_ALPHA) * adaptive->slope;
+    }
+  adaptive->last_temp = temp;
+  adaptive->last_time = now;
+  adaptive->have_last = TRUE;
+
+  int up_margin = range_max - temp;
+  int old_ms = adaptive->interval_ms;
+  int new_ms = old_ms;
+
+  if (up_margin <= ADAPTIVE_NEAR || temp < range_min)
+    new_ms = adaptive->min_ms;
+  else if (adaptive->slope > ADAPTIVE_RISING)
+    {
+    new_ms = old_ms / 2;
+    // How long before we reach the next boundary, at the current rate?
+    int to_boundary_ms = (int)(1000 * up_margin / adaptive->slope);
+    if (to_boundary_ms / ADAPTIVE_POLLS_TO_BOUNDARY < new_ms)
+      new_ms = to_boundary_ms / ADAPTIVE_POLLS_TO_BOUNDARY;
+    }
+  else if (adaptive->slope < ADAPTIVE_FLAT && adaptive->slope > -ADAPTIVE_FLAT
+      && up_margin >= ADAPTIVE_FAR)
+    new_ms = old_ms + old_ms / 2;
+
+  if (new_ms < adaptive->min_ms) new_ms = adaptive->min_ms;
+  if (new_ms > adaptive->max_ms) new_ms = adaptive->max_ms;
+  adaptive->interval_ms = new_ms;
+
+  if (new_ms != old_ms)
+    mylog_info ("Poll interval now %dms (slope %.2fC/s, %d polls/hour)",
+      new_ms, adaptive->slope, 3600000 / new_ms);
+  return new_ms;
+  }
+
@@ -0,0 +1,28 @@
+/*=============================================================================
+
+  p53-fan
+  adaptive.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+typedef struct _Adaptive
+  {
+  int min_ms; // The floor and ceiling of the poll interval
+  int max_ms;
+  int interval_ms; // The interval currently in use
+  double slope; // Smoothed rate of change of temperature, C/sec
+  int last_temp;
+  double last_time;
+  BOOL have_last;
+  } Adaptive;
+
+extern void adaptive_init (Adaptive *adaptive, int min_ms, int max_ms, 
+         int start_ms);
+extern int adaptive_next (Adaptive *adaptive, double now, int temp, 
+         int range_min, int range_max);
+
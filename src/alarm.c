@@ -0,0 +1,185 @@
+/*=============================================================================
+
+  p53-fan
+  alarm.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Temperature alarms. Some hwmon drivers have a writable tempN_max 
+  threshold for a sensor, and a tempN_max_alarm file that changes to 1 when
+  the temperature passes it. Those that notify sysfs when the alarm 
+  changes wake anything that is polling the alarm file for POLLPRI. So we
+  set the threshold to the temperature at which the fan curve would next 
+  raise the fan, and poll the alarm file from the main loop; when the 
+  alarm goes off, the main loop polls at once, without waiting for the 
+  next interval.
+
+  The thresholds belong to the hardware, and something else might depend
+  on them, so we remember the original values and put them back when we
+  stop, or when the sensor table changes.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include "defs.h"
+#include "mylog.h"
+#include "evloop.h"
+#include "alarm.h"
+
+/**
+  read_int
+*/
+static int read_int (int fd, int *value)
+  {
+  char buff[32];
+  int n = pread (fd, buff, sizeof (buff) - 1, 0);
+  if (n <= 0) return -1;
+  buff[n] = 0;
+  *value = atoi (buff);
+  return 0;
+  }
+
+/**
+  write_int
+*/
+static int write_int (int fd, int value)
+  {
+  char buff[32];
+  int n = snprintf (buff, sizeof (buff), "%d", value);
+  return pwrite (fd, buff, n, 0) == n ? 0 : -1;
+  }
+
+/**
+  release
+
+  Put back the original thresholds, stop watching the alarms, and close 
+everything.
+*/
+static void release (Alarms *alarms)
+  {
+  for (int i = 0; i < alarms->n; i++)
+    {
+    Alarm *a = &alarms->alarms[i];
+    if (alarms->threshold) write_int (a->max_fd, a->saved);
+    evloop_remove (a->alarm_fd);
+    close (a->alarm_fd);
+    close (a->max_fd);
+    }
+  alarms->n = 0;
+  alarms->threshold = 0;
+  alarms->built = FALSE;
+  }
+
+/**
+  find_alarm
+
+  If the sensor has a writable threshold and an alarm that can be watched,
+add it to the alarms. 
+*/
+static void find_alarm (Alarms *alarms, const HSContext *context, 
+         const HSSensor *s)
+  {
+  int dirfd = context->devices[s->device].dirfd;
+  const char *p = strrchr (s->file, '_');
+  if (!p) return;
+  char max_file[48], alarm_file[64];
+  snprintf (max_file, sizeof (max_file), "%.*s_max", (int)(p - s->file), 
+    s->file);
+  snprintf (alarm_file, sizeof (alarm_file), "%s_alarm", max_file);
+
+  Alarm *a = &alarms->alarms[alarms->n];
+  a->max_fd = openat (dirfd, max_file, O_RDWR | O_CLOEXEC);
+  if (a->max_fd < 0) return;
+  a->alarm_fd = openat (dirfd, alarm_file, O_RDONLY | O_CLOEXEC);
+  int value;
+  // The alarm file has to be read once before sysfs will notify us
+  if (a->alarm_fd < 0 || read_int (a->max_fd, &a->saved) != 0
+      || read_int (a->alarm_fd, &value) != 0
+      || evloop_add (a->alarm_fd, EPOLLPRI, alarms->handler, 
+           alarms->data) != 0)
+    {
+    mylog_debug ("Can't watch alarm '%s' for '%s'", alarm_file, s->path);
+    if (a->alarm_fd >= 0) close (a->alarm_fd);
+    close (a->max_fd);
+    return;
+    }
+  a->offset = s->offset;
+  alarms->n++;
+  mylog_info ("Watching alarm '%s' for '%s'", alarm_file, s->path);
+  }
+
+/**
+  alarm_init
+
+  handler is called from the event loop with the alarm file's descriptor,
+when an alarm changes. It should call alarm_ack().
+*/
+void alarm_init (Alarms *alarms, EvHandler handler, void *data)
+  {
+  memset (alarms, 0, sizeof (Alarms));
+  alarms->handler = handler;
+  alarms->data = data;
+  }
+
+/**
+  alarm_arm
+
+  Set every alarm threshold to the temperature at which the fan should next
+be raised. If the sensor table has changed, look for alarms again first. A
+threshold above ALARM_TEMP_MAX (that is, the fan is already as high as it
+goes) puts back the original thresholds. Returns the number of alarms.
+*/
+int alarm_arm (Alarms *alarms, const HSContext *context, int threshold)
+  {
+  if (alarms->built && alarms->generation != context->generation)
+    release (alarms);
+  if (!alarms->built)
+    {
+    for (int i = 0; i < context->nsensors && alarms->n < ALARM_MAX; i++)
+      find_alarm (alarms, context, &context->sensors[i]);
+    alarms->built = TRUE;
+    alarms->generation = context->generation;
+    }
+  if (threshold > ALARM_TEMP_MAX) threshold = 0;
+  if (threshold == alarms->threshold) return alarms->n;
+  for (int i = 0; i < alarms->n; i++)
+    {
+    Alarm *a = &alarms->alarms[i];
+    int value = threshold ? (threshold - a->offset) * 1000 : a->saved;
+    if (write_int (a->max_fd, value) != 0)
+      mylog_debug ("Can't set alarm threshold to %d: %s", value, 
+        strerror (errno));
+    }
+  if (alarms->n > 0) 
+    mylog_debug ("Alarm threshold is %dC", threshold);
+  alarms->threshold = threshold;
+  return alarms->n;
+  }
+
+/**
+  alarm_ack
+
+  Read an alarm file after it has been notified, so that poll() will wait 
+for the next change. Returns TRUE if the alarm is raised.
+*/
+BOOL alarm_ack (int fd)
+  {
+  int value = 0;
+  read_int (fd, &value);
+  return value != 0;
+  }
+
+/**
+  alarm_done
+
+  Put back the original thresholds, and stop watching the alarms.
+*/
+void alarm_done (Alarms *alarms)
+  {
+  release (alarms);
+  }
@@ -0,0 +1,40 @@
+/*=============================================================================
+
+  p53-fan
+  alarm.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+#include "config.h"
+#include "evloop.h"
+#include "hwmon_scan.h"
+
+// One sensor whose driver raises an alarm when it passes tempN_max
+typedef struct _Alarm
+  {
+  int max_fd; // tempN_max
+  int alarm_fd; // tempN_max_alarm, watched for EPOLLPRI
+  int saved; // The value of tempN_max before we changed it
+  int offset; // The sensor's offset, from the sensor rules
+  } Alarm;
+
+typedef struct _Alarms
+  {
+  int n;
+  Alarm alarms[ALARM_MAX];
+  BOOL built; // TRUE once we've looked for alarms in the sensor table
+  unsigned generation; // The sensor table generation we looked at
+  int threshold; // The temperature the alarms are set to; 0 for none
+  EvHandler handler; // Called when an alarm changes
+  void *data;
+  } Alarms;
+
+extern void alarm_init (Alarms *alarms, EvHandler handler, void *data);
+extern int alarm_arm (Alarms *alarms, const HSContext *context, 
+         int threshold);
+extern BOOL alarm_ack (int fd);
+extern void alarm_done (Alarms *alarms);
@@ -10,7 +10,84 @@
 
 #define HWMON_ROOT "/sys/class/hwmon"
 #define FAN_FILE "/proc/acpi/ibm/fan"
+#define POWERCAP_ROOT "/sys/class/powercap"
+#define CPU_ROOT "/sys/devices/system/cpu"
 #define LOCK_FILE "/tmp/p53-fan.lck"
+#define CURVE_FILE "/etc/p53-fan/curves"
+#define RULES_FILE "/etc/p53-fan/sensors"
+#define RUN_DIR "/run/p53-fan"
+#define CONTROL_SOCKET RUN_DIR "/control"
+// In a recorded trace, a gap between ticks longer than this means the 
+//   program wasn't running
+#define TRACE_MAX_GAP_MS 60000
 
+// The sensor table, saved so the next start can skip discovery
+#define SENSOR_MANIFEST RUN_DIR "/sensors"
 
+// The latest temperatures and fan level, for other programs to read
+#define STATUS_PAGE RUN_DIR "/status"
 
+// How often (in polls) to rebuild the sensor table, to pick up hwmon drivers
+//   that are loaded after we start
+#define HWMON_REDISCOVER_POLLS 60
+
+// A sensor that keeps failing to read has its device re-read after 1, 2, 4,
+//   ... failed polls, and then every HWMON_RETRY_POLLS_MAX polls
+#define HWMON_RETRY_POLLS_MAX 256
+
+// How often to read storage (NVME and drivetemp) sensors, by default. The
+//   last value read is used in between, but not if it's older than
+//   HWMON_STALE_FACTOR periods
+#define DEFAULT_SLOW_INTERVAL_MS 30000
+#define HWMON_STALE_FACTOR 3
+
+// With --uring, the number of sensors that can be read in one batch, and
+//   how long we wait for them
+#define HWMON_URING_ENTRIES 1024
+#define HWMON_URING_DEADLINE_MS 100
+
+// Limits on the poll interval, when it adapts to the temperature, if the
+//   user only specifies one of them
+#define DEFAULT_MIN_INTERVAL_MS 1000
+#define DEFAULT_MAX_INTERVAL_MS 30000
+
+// The temperature that the PID controller tries to stay below, by default
+#define DEFAULT_PID_TARGET 70
+
+// Where CPU load comes from, for --load-boost, and how often the extra fan
+//   levels added on a load step fall away, one at a time
+#define LOAD_STAT_FILE "/proc/stat"
+#define LOAD_PSI_FILE "/proc/pressure/cpu"
+#define LOAD_DECAY_MS 10000
+
+// With --alarms, the most sensors whose alarms we watch, the highest 
+//   temperature we'll set an alarm threshold to, and the shortest gap
+//   between polls that alarms can cause
+#define ALARM_MAX 16
+#define ALARM_TEMP_MAX 110
+#define ALARM_MIN_GAP_MS 100
+
+// How long the fan takes to settle at a new speed, before we check it; how
+//   often to check it otherwise; how many checks at a level it takes to 
+//   learn the speed to expect there; the percentage of that speed below 
+//   which the fan is failing; and how long to keep the fan raised after 
+//   the last failure
+#define RPM_SETTLE_MS 5000
+#define RPM_CHECK_MS 30000
+#define RPM_LEARN_SAMPLES 3
+#define RPM_LOW_PERCENT 50
+#define RPM_HOLD_MS 60000
+
+// After the CPU was last throttled, keep the fan a level above the curve 
+//   for this long
+#define THROTTLE_HOLD_MS 30000
+
+// Once the main loop is running, log messages go through a ring buffer of
+//   this many entries (a power of two), each holding one formatted line,
+//   and are written out by a background thread this often
+#define LOG_RING_SIZE 256
+#define LOG_LINE_MAX 256
+#define LOG_FLUSH_MS 250
+// A message that repeats the last one from the same place in the code is
+//   counted, rather than logged, and the count is logged this often
+#define LOG_REPEAT_MS 60000
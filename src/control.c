@@ -0,0 +1,294 @@
+/*=============================================================================
+
+  p53-fan
+  control.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "defs.h" 
+#include "mylog.h" 
+#include "evloop.h" 
+#include "control.h" 
+
+// Clients send one command line, and get one reply. Some commands hold the
+//   connection open afterwards (see do_conn()), but we still don't expect 
+//   more than a few of them at the same time.
+#define CONTROL_MAX_CONN 16
+#define CONTROL_LINE_MAX 256
+
+typedef struct _ControlConn
+  {
+  int fd;
+  int len;
+  BOOL held; // TRUE if the connection stays open after the reply
+  char buff[CONTROL_LINE_MAX];
+  } ControlConn;
+
+static int listen_fd = -1;
+static char socket_path[108] = "";
+static ControlHandler control_handler;
+static ControlHangup control_hangup;
+static void *control_data;
+static ControlConn conns[CONTROL_MAX_CONN];
+
+/**
+  close_conn
+
+  Close a client connection. If it was being held open, the hangup handler
+is told.
+*/
+static void close_conn (ControlConn *conn)
+  {
+  evloop_remove (conn->fd);
+  close (conn->fd);
+  conn->fd = -1;
+  if (conn->held && control_hangup) 
+    control_hangup (conn - conns, control_data);
+  conn->held = FALSE;
+  }
+
+/**
+  do_conn
+
+  Called when a client connection is readable. When we have a whole line, we
+pass it to the handler, send the reply, and hang up -- unless the handler
+asks for the connection to be held open. A held connection lasts until the
+client hangs up; anything else it sends is ignored.
+*/
+static void do_conn (int fd, unsigned events, void *data)
+  {
+  ControlConn *conn = data;
+  if (conn->held)
+    {
+    char buff[CONTROL_LINE_MAX];
+    int n = read (fd, buff, sizeof (buff));
+    if (n == 0 || (n < 0 && errno != EAGAIN)) close_conn (conn);
+    return;
+    }
+  int n = read (fd, conn->buff + conn->len, 
+    sizeof (conn->buff) - conn->len - 1);
+  if (n < 0 && errno == EAGAIN) return;
+  if (n > 0) conn->len += n;
+  conn->buff[conn->len] = 0;
+  char *nl = strchr (conn->buff, '\n');
+  if (nl) *nl = 0;
+  // If the client sent a line, or hung up, or filled the buffer, that's the
+  //   command
+  if (nl || n <= 0 || conn->len == sizeof (conn->buff) - 1)
+    {
+    BOOL hold = FALSE;
+    if (conn->len > 0)
+      {
+      char reply[8192];
+      reply[0] = 0;
+      mylog_debug ("Control command: %s", conn->buff);
+      hold = control_handler (conn - conns, conn->buff, reply, 
+        sizeof (reply) - 1, control_data);
+      strcat (reply, "\n");
+      write (fd, reply, strlen (reply));
+      }
+    // A client that has already hung up can't hold anything
+    conn->held = hold && n > 0;
+    if (conn->held)
+      conn->len = 0;
+    else
+      {
+      if (hold && control_hangup) 
+        control_hangup (conn - conns, control_data);
+      close_conn (conn);
+      }
+    }
+  }
+
+/**
+  do_accept
+
+  Called when there's a new connection on the control socket.
+*/
+static void do_accept (int fd, unsigned events, void *data)
+  {
+  int conn_fd = accept4 (fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (conn_fd < 0) return;
+  for (int i = 0; i < CONTROL_MAX_CONN; i++)
+    {
+    ControlConn *conn = &conns[i];
+    if (conn->fd >= 0) continue;
+    conn->fd = conn_fd;
+    conn->len = 0;
+    conn->held = FALSE;
+    if (evloop_add (conn_fd, EPOLLIN, do_conn, conn) != 0)
+      {
+      close (conn_fd);
+      conn->fd = -1;
+      }
+    return;
+    }
+  mylog_warn ("Too many control connections");
+  close (conn_fd);
+  }
+
+/**
+  control_init
+
+  Create the control socket at path, and start accepting commands from it in
+the event loop. Only root (or, more precisely, our own user) can connect.
+hangup, which may be NULL, is called when a connection that the handler
+asked to hold is closed. Returns 0 on success.
+*/
+int control_init (const char *path, ControlHandler handler, 
+      ControlHangup hangup, void *data)
+  {
+  control_handler = handler;
+  control_hangup = hangup;
+  control_data = data;
+  for (int i = 0; i < CONTROL_MAX_CONN; i++)
+    {
+    conns[i].fd = -1;
+    conns[i].held = FALSE;
+    }
+
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+    mylog_error ("Control socket path '%s' is too long", path);
+    return -1;
+    }
+  strcpy (addr.sun_path, path);
+
+  listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0)
+    {
+    mylog_warn ("Can't create control socket: %s", strerror (errno));
+    return -1;
+    }
+  // We hold the lock, so any existing socket must be left over from an 
+  //   instance that didn't shut down cleanly
+  unlink (path);
+  mode_t old_mask = umask (077);
+  int ret = bind (listen_fd, (struct sockaddr *)&addr, sizeof (addr));
+  umask (old_mask);
+  if (ret != 0 || listen (listen_fd, CONTROL_MAX_CONN) != 0)
+    {
+    mylog_warn ("Can't listen on control socket '%s': %s", path, 
+      strerror (errno));
+    close (listen_fd);
+    listen_fd = -1;
+    return -1;
+    }
+  strcpy (socket_path, path);
+  return evloop_add (listen_fd, EPOLLIN, do_accept, NULL);
+  }
+
+/**
+  control_done
+
+  Close the control socket, and any client connections, and remove the
+socket from the filesystem.
+*/
+void control_done (void)
+  {
+  for (int i = 0; i < CONTROL_MAX_CONN; i++)
+    if (conns[i].fd >= 0) close_conn (&conns[i]);
+  if (listen_fd >= 0)
+    {
+    evloop_remove (listen_fd);
+    close (listen_fd);
+    unlink (socket_path);
+    }
+  listen_fd = -1;
+  }
+
+/**
+  connect_to
+
+  Connect to the control socket at path, and send a command. Returns the
+connected descriptor, or -1.
+*/
+static int connect_to (const char *path, const char *command)
+  {
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+    {
+    mylog_error ("Can't connect to '%s': is program running?", path);
+    close (fd);
+    return -1;
+    }
+  char line[CONTROL_LINE_MAX];
+  snprintf (line, sizeof (line), "%s\n", command);
+  write (fd, line, strlen (line));
+  return fd;
+  }
+
+/**
+  control_send
+
+  This is the client side: send a command to a running instance, and wait for
+its reply. Returns 0 if we got a reply.
+*/
+int control_send (const char *path, const char *command, char *reply, 
+      int reply_len)
+  {
+  int fd = connect_to (path, command);
+  if (fd < 0) return -1;
+  int total = 0;
+  int n;
+  while (total < reply_len - 1 
+      && (n = read (fd, reply + total, reply_len - 1 - total)) > 0)
+    total += n;
+  reply[total] = 0;
+  if (total > 0 && reply[total - 1] == '\n') reply[total - 1] = 0;
+  close (fd);
+  return total > 0 ? 0 : -1;
+  }
+
+/**
+  control_hold
+
+  Like control_send(), but for a command that holds the connection open: 
+wait for the first line of the reply, and return the still-connected 
+descriptor, or -1 if there is no reply. Whatever the command set up lasts 
+until the caller closes the descriptor, or exits.
+*/
+int control_hold (const char *path, const char *command, char *reply, 
+      int reply_len)
+  {
+  int fd = connect_to (path, command);
+  if (fd < 0) return -1;
+  int total = 0;
+  while (total < reply_len - 1 && (total == 0 || reply[total - 1] != '\n'))
+    {
+    int n = read (fd, reply + total, 1);
+    if (n <= 0) break;
+    total += n;
+    }
+  reply[total] = 0;
+  if (total > 0 && reply[total - 1] == '\n') reply[total - 1] = 0;
+  if (total == 0)
+    {
+    close (fd);
+    return -1;
+    }
+  return fd;
+  }
@@ -0,0 +1,29 @@
+/*=============================================================================
+
+  p53-fan
+  control.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+// A control handler is called with each command line received on the 
+//   control socket, and fills in the reply, which is sent back to the 
+//   client. client identifies the connection. If the handler returns TRUE,
+//   the connection is held open after the reply, until the client hangs up,
+//   and then the hangup handler is called with the same client.
+typedef BOOL (*ControlHandler) (int client, const char *command, char *reply, 
+         int reply_len, void *data);
+typedef void (*ControlHangup) (int client, void *data);
+
+extern int control_init (const char *path, ControlHandler handler, 
+         ControlHangup hangup, void *data);
+extern void control_done (void);
+extern int control_send (const char *path, const char *command, 
+         char *reply, int reply_len);
+extern int control_hold (const char *path, const char *command, 
+         char *reply, int reply_len);
+
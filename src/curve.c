@@ -9,9 +9,12 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "defs.h"
 #include "mylog.h"
 #include "fan.h"
+#include "config.h"
 #include "curve.h"
 
 #define MAX_RANGES 9 
@@ -29,6 +32,24 @@ use 8 internally to specify 'disengaged' mode at high temperatures. */
 
 typedef FanRange FanCurve[FAN_MAX + 1];
 
+/* Each curve is compiled into a table of fan levels, indexed by the previous
+fan level and the temperature. */
+
+typedef unsigned char 
+  CurveTable[FAN_MAX + 1][CURVE_TEMP_MAX - CURVE_TEMP_MIN + 1];
+
+struct _Curve
+  {
+  char name[32];
+  FanCurve ranges;
+  CurveTable table;
+  };
+
+// All the curves we know about: the built-in ones, then any from the curve
+//   file. This doesn't change after curve_init().
+static Curve *curves = NULL;
+static int ncurves = 0;
+
 FanCurve fan_curve_hot = 
   {
   {-273, 56},
@@ -96,83 +117,314 @@ FanCurve fan_curve_cold =
 
 
 /**
-  curve_from_number
-  Get the curve structure that corresponds to the specific curve number.  The
-curve number is in the range 0-4, but it's better to use the constants defined
-in curve.h.
+  curve_get_name
+  Return the name of a curve.
 */
-static const FanCurve *curve_from_number (CurveNum curve_num)
+const char *curve_get_name (const Curve *curve)
   {
-  switch (curve_num)
-    {
-    case CURVE_COLD: return &fan_curve_cold;
-    case CURVE_COOL: return &fan_curve_cool;
-    case CURVE_MEDIUM: return &fan_curve_medium;
-    case CURVE_WARM: return &fan_curve_warm;
-    case CURVE_HOT: return &fan_curve_hot;
-    }
-  return NULL; // Should never happen
+  return curve->name;
+  }
+
+/**
+  curve_find
+  Return the curve with the specified name, or NULL if there isn't one.
+*/
+const Curve *curve_find (const char *name)
+  {
+  for (int i = 0; i < ncurves; i++)
+    if (strcmp (curves[i].name, name) == 0) return &curves[i];
+  return NULL;
   }
 
 /**
-  get_curve_name
-  Return a string representation of the curve with the specified number.
+  curve_get_count
+  Return the number of curves, including the built-in ones. Use this with
+curve_get() to list all the curves.
 */
-const char *curve_get_name (CurveNum curve_num)
+int curve_get_count (void)
   {
-  switch (curve_num)
+  return ncurves;
+  }
+
+/**
+  curve_get
+*/
+const Curve *curve_get (int n)
+  {
+  return &curves[n];
+  }
+
+/**
+  curve_get_range
+  Get the temperature range for a specific level of a curve. The fan stays at
+this level while the temperature is at least min, and less than max.
+*/
+void curve_get_range (const Curve *curve, int level, int *min, int *max)
+  {
+  const FanRange *range = &curve->ranges[level];
+  *min = range->min;
+  *max = range->max;
+  }
+
+/**
+  search_level
+  For a given curve, work out the fan level that corresponds to the
+temperature. A specific temperature can match multiple fan levels, because of
+hysteresis. So we first check whether the temperature is a match for the
+previous level. If it is, we don't have to change it. Then, if there's no
+match, we search the curve _downwards_ from the highest fan level (and thus
+the highest temperature). If the temperature appears in multiple fan levels,
+for safety we should pick the highest one. Returns -1 if the temperature
+isn't in any range.
+
+  This is only used to build the lookup tables; see curve_compile().
+*/
+static int search_level (const FanCurve *fan_curve, int old_level, int temp)
+  {
+  if (old_level >= 0)
+    {
+    const FanRange *current_range = &((*fan_curve)[old_level]);
+    if (temp >= current_range->min && temp < current_range->max)
+      return old_level; 
+    }
+
+  // Search downwards, from higher temperatures to lower
+  for (int i = MAX_RANGES - 1; i >= 0; i--)
     {
-    case CURVE_COLD: return "cold";
-    case CURVE_COOL: return "cool"; 
-    case CURVE_MEDIUM: return "medium";
-    case CURVE_WARM: return "warm"; 
-    case CURVE_HOT: return "hot"; 
+    const FanRange *test_range = &((*fan_curve)[i]);
+    if (temp >= test_range->min && temp < test_range->max)
+      return i;
     }
-  return NULL; // Should never happen
+  return -1;
   }
 
 /**
-  curve_get_level
-  For a given curve, return the fan level that corresponds to the temperature.
-A specific temperature can match multiple fan levels, because of hysteresis.
-So we first check whether the temperature is a match for the previous level.
-If it is, we don't have to change it. Then, if there's no match, we search the
-curve _downwards_ from the highest fan level (and thus the highest
-temperature). If the temperature appears in multiple fan levels, for safety we
-should pick the highest one. 
+  curve_compile
+  Check that a fan curve makes sense, and build its lookup table. The table
+has an entry for every combination of previous fan level and temperature from
+CURVE_TEMP_MIN to CURVE_TEMP_MAX, so choosing a fan level at runtime is just
+an array lookup. Temperatures outside that range are clamped, so the curve's
+boundaries have to be inside it. 
+
+  The curve must have ranges that increase monotonically, leave no gaps in
+the temperature scale, and allow every fan level to be reached. Returns 0 if
+the curve is valid, or -1 (having logged the reason) if not.
 */
-int curve_get_level (CurveNum curve_num, int old_level, int temp)
+static int curve_compile (const char *name, const FanCurve *fan_curve, 
+         CurveTable *table)
   {
-  if (old_level < 0 || old_level >= MAX_RANGES)
+  for (int i = 0; i < MAX_RANGES; i++)
     {
-    mylog_error ("Internal error: fan level is %d ???", old_level);
-    return old_level;
+    const FanRange *r = &((*fan_curve)[i]);
+    if (r->min >= r->max)
+      {
+      mylog_error ("Curve '%s': level %d has an empty range %d-%d", 
+        name, i, r->min, r->max);
+      return -1;
+      }
+    if (i > 0)
+      {
+      const FanRange *prev = &((*fan_curve)[i - 1]);
+      if (r->min <= prev->min || r->max <= prev->max)
+        {
+        mylog_error ("Curve '%s': level %d range %d-%d is not above "
+          "level %d range %d-%d", name, i, r->min, r->max, i - 1, 
+          prev->min, prev->max);
+        return -1;
+        }
+      if (r->min > prev->max)
+        {
+        mylog_error ("Curve '%s': there is a gap between %dC and %dC", 
+          name, prev->max, r->min);
+        return -1;
+        }
+      if (r->min <= CURVE_TEMP_MIN || r->min > CURVE_TEMP_MAX)
+        {
+        mylog_error ("Curve '%s': level %d starts at %dC, outside %d-%dC", 
+          name, i, r->min, CURVE_TEMP_MIN, CURVE_TEMP_MAX);
+        return -1;
+        }
+      }
+    if (i < MAX_RANGES - 1 && (r->max <= CURVE_TEMP_MIN 
+        || r->max > CURVE_TEMP_MAX))
+      {
+      mylog_error ("Curve '%s': level %d ends at %dC, outside %d-%dC", 
+        name, i, r->max, CURVE_TEMP_MIN, CURVE_TEMP_MAX);
+      return -1;
+      }
+    }
+  if ((*fan_curve)[0].min > CURVE_TEMP_MIN 
+      || (*fan_curve)[MAX_RANGES - 1].max <= CURVE_TEMP_MAX)
+    {
+    mylog_error ("Curve '%s' does not cover all temperatures from %d to %dC", 
+      name, CURVE_TEMP_MIN, CURVE_TEMP_MAX);
+    return -1;
     }
- 
-  const FanCurve *fan_curve = curve_from_number (curve_num); 
 
-  const FanRange *current_range = &((*fan_curve)[old_level]);
-  if (temp >= current_range->min && temp < current_range->max)
+  BOOL reachable[MAX_RANGES] = { FALSE };
+  for (int t = CURVE_TEMP_MIN; t <= CURVE_TEMP_MAX; t++)
+    {
+    reachable[search_level (fan_curve, -1, t)] = TRUE;
+    for (int old = 0; old < MAX_RANGES; old++)
+      (*table)[old][t - CURVE_TEMP_MIN] = search_level (fan_curve, old, t);
+    }
+  for (int i = 0; i < MAX_RANGES; i++)
+    {
+    if (!reachable[i])
       {
-      mylog_debug ("Current temp %d is in existing range %d-%d, level %d", 
-          temp, current_range->min, current_range->max, old_level);
-      return old_level; 
+      mylog_error ("Curve '%s': level %d can never be selected", name, i);
+      return -1;
       }
+    }
+  return 0;
+  }
 
-  // Search downwards, from higher temperatures to lower
-  for (int i = MAX_RANGES - 1; i >= 0; i--)
+/**
+  add_curve
+  Validate and compile a curve, and add it to the list of curves. A curve
+with the same name as an existing one replaces it. Returns 0 if the curve
+is valid.
+*/
+static int add_curve (const char *name, const FanCurve *fan_curve)
+  {
+  Curve curve;
+  strncpy (curve.name, name, sizeof (curve.name));
+  curve.name[sizeof (curve.name) - 1] = 0;
+  memcpy (curve.ranges, fan_curve, sizeof (FanCurve));
+  if (curve_compile (name, fan_curve, &curve.table) != 0) return -1;
+
+  Curve *existing = (Curve *)curve_find (curve.name);
+  if (existing)
     {
-    const FanRange *test_range = &((*fan_curve)[i]);
-    if (temp >= test_range->min && temp < test_range->max)
+    mylog_debug ("Curve '%s' replaces the built-in curve", curve.name);
+    *existing = curve;
+    return 0;
+    }
+  Curve *new_curves = realloc (curves, (ncurves + 1) * sizeof (Curve));
+  if (!new_curves) return -1;
+  curves = new_curves;
+  curves[ncurves++] = curve;
+  return 0;
+  }
+
+/**
+  load_curves
+  Read curve definitions from a file. Each curve starts with a line 'curve
+NAME', followed by exactly nine lines, each with the minimum and maximum 
+temperatures for one fan level, from 0 to 8. Blank lines and anything after
+'#' are ignored. For example:
+
+  curve quiet
+  -273 56
+  55 60
+  ...
+  75 255
+
+  Returns 0 if the file was read and all its curves are valid. If the file
+does not exist, that's only an error if must_exist is TRUE.
+*/
+static int load_curves (const char *filename, BOOL must_exist)
+  {
+  FILE *f = fopen (filename, "r");
+  if (!f)
+    {
+    if (!must_exist && errno == ENOENT) return 0;
+    mylog_error ("Can't open curve file '%s': %s", filename, strerror (errno));
+    return -1;
+    }
+  
+  int ret = 0;
+  char line[256];
+  int line_num = 0;
+  char name[32] = "";
+  FanCurve fan_curve;
+  int level = -1; // The next level we expect, or -1 if not in a curve
+  while (ret == 0 && fgets (line, sizeof (line), f))
+    {
+    line_num++;
+    char *p = strchr (line, '#');
+    if (p) *p = 0;
+    char word[32];
+    int min, max;
+    if (sscanf (line, "%31s", word) != 1) continue; // Blank
+    if (strcmp (word, "curve") == 0)
       {
-      mylog_debug ("Current temp is in new range %d-%d, level %d", 
-          test_range->min, test_range->max, i);
-      return i;
+      if (level >= 0) 
+        {
+        mylog_error ("%s:%d: curve '%s' has only %d levels", filename, 
+          line_num, name, level);
+        ret = -1;
+        }
+      else if (sscanf (line, "%*s %31s", name) != 1)
+        {
+        mylog_error ("%s:%d: curve has no name", filename, line_num);
+        ret = -1;
+        }
+      level = 0;
+      }
+    else if (level >= 0 && sscanf (line, "%d %d", &min, &max) == 2)
+      {
+      fan_curve[level].min = min;
+      fan_curve[level].max = max;
+      if (++level == MAX_RANGES)
+        {
+        if (add_curve (name, &fan_curve) != 0)
+          {
+          mylog_error ("%s:%d: invalid curve '%s'", filename, line_num, name);
+          ret = -1;
+          }
+        level = -1;
+        }
       }
+    else
+      {
+      mylog_error ("%s:%d: can't understand '%s'", filename, line_num, word);
+      ret = -1;
+      }
+    }
+  if (ret == 0 && level >= 0)
+    {
+    mylog_error ("%s: curve '%s' has only %d levels", filename, name, level);
+    ret = -1;
     }
+  fclose (f);
+  return ret;
+  }
 
-  mylog_error ("Internal error: temp %d is not in any range on curve", temp);
-  return old_level;
+/**
+  curve_init
+  Validate all the built-in curves, and any in the curve file, and build
+their lookup tables. This must be called before any other curve_ function.
+If filename is NULL, we use the default curve file, if it exists. Returns 0
+if all the curves are valid.
+*/
+int curve_init (const char *filename)
+  {
+  if (add_curve ("cold", &fan_curve_cold) != 0) return -1;
+  if (add_curve ("cool", &fan_curve_cool) != 0) return -1;
+  if (add_curve ("medium", &fan_curve_medium) != 0) return -1;
+  if (add_curve ("warm", &fan_curve_warm) != 0) return -1;
+  if (add_curve ("hot", &fan_curve_hot) != 0) return -1;
+  if (filename)
+    return load_curves (filename, TRUE);
+  return load_curves (CURVE_FILE, FALSE);
   }
 
+/**
+  curve_get_level
+  For a given curve, return the fan level that corresponds to the temperature,
+given the previous fan level. The work was all done in advance, by
+curve_compile(), so this is just a lookup.
+*/
+int curve_get_level (const Curve *curve, int old_level, int temp)
+  {
+  if (old_level < 0 || old_level >= MAX_RANGES)
+    {
+    mylog_error ("Internal error: fan level is %d ???", old_level);
+    return old_level;
+    }
+  if (temp < CURVE_TEMP_MIN) temp = CURVE_TEMP_MIN;
+  if (temp > CURVE_TEMP_MAX) temp = CURVE_TEMP_MAX;
+  return curve->table[old_level][temp - CURVE_TEMP_MIN];
+  }
 
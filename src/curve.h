@@ -8,15 +8,19 @@
 
 #pragma once
 
-// Constants defining the fan curve number to use
-typedef enum _CurveNum
-  {
-  CURVE_COLD=0,
-  CURVE_COOL=1,
-  CURVE_MEDIUM=2,
-  CURVE_WARM=3,
-  CURVE_HOT=4
-  } CurveNum;
+// A named fan curve, compiled for fast lookup. See curve.c
+typedef struct _Curve Curve;
 
-extern int curve_get_level (CurveNum curve_num, int old_level, int temp);
-extern const char *curve_get_name (CurveNum curve_num);
+// The range of temperatures covered by the curve lookup tables. Temperatures
+//   outside this range are clamped to it.
+#define CURVE_TEMP_MIN 0
+#define CURVE_TEMP_MAX 127
+
+extern int curve_init (const char *filename);
+extern const Curve *curve_find (const char *name);
+extern int curve_get_count (void);
+extern const Curve *curve_get (int n);
+extern int curve_get_level (const Curve *curve, int old_level, int temp);
+extern const char *curve_get_name (const Curve *curve);
+extern void curve_get_range (const Curve *curve, int level, int *min, 
+         int *max);
@@ -0,0 +1,149 @@
+/*=============================================================================
+
+  p53-fan
+  evloop.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include "defs.h"
+#include "mylog.h"
+#include "evloop.h"
+
+// There's only ever a handful of descriptors to watch: the timer, the
+//   signal descriptor, the uevent socket, and so on. 
+#define EVLOOP_MAX 64
+
+typedef struct _EvWatch
+  {
+  int fd;
+  EvHandler handler;
+  void *data;
+  } EvWatch;
+
+static int epoll_fd = -1;
+static EvWatch watches[EVLOOP_MAX];
+static BOOL quit = FALSE;
+
+/**
+  evloop_init
+
+  Create the epoll instance. Returns 0 on success.
+*/
+int evloop_init (void)
+  {
+  epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    {
+    mylog_error ("Can't create epoll instance: %s", strerror (errno));
+    return -1;
+    }
+  for (int i = 0; i < EVLOOP_MAX; i++)
+    watches[i].fd = -1;
+  quit = FALSE;
+  return 0;
+  }
+
+/**
+  evloop_add
+
+  Start watching fd for the specified epoll events (usually EPOLLIN). When
+the descriptor is ready, handler is called from evloop_run(). 
+*/
+int evloop_add (int fd, unsigned events, EvHandler handler, void *data)
+  {
+  for (int i = 0; i < EVLOOP_MAX; i++)
+    {
+    EvWatch *w = &watches[i];
+    if (w->fd >= 0) continue;
+    struct epoll_event ev;
+    memset (&ev, 0, sizeof (ev));
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+      {
+      mylog_error ("Can't watch descriptor %d: %s", fd, strerror (errno));
+      return -1;
+      }
+    w->fd = fd;
+    w->handler = handler;
+    w->data = data;
+    return 0;
+    }
+  mylog_error ("Internal error: too many descriptors in event loop");
+  return -1;
+  }
+
+/**
+  evloop_remove
+
+  Stop watching fd. This does not close it. 
+*/
+void evloop_remove (int fd)
+  {
+  for (int i = 0; i < EVLOOP_MAX; i++)
+    {
+    if (watches[i].fd == fd)
+      {
+      epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+      watches[i].fd = -1;
+      }
+    }
+  }
+
+/**
+  evloop_run
+
+  Wait for descriptors to become ready, and call their handlers, until a 
+handler calls evloop_quit(). Returns 0 if the loop ended that way, or -1 if
+epoll itself failed.
+*/
+int evloop_run (void)
+  {
+  while (!quit)
+    {
+    struct epoll_event events[EVLOOP_MAX];
+    int n = epoll_wait (epoll_fd, events, EVLOOP_MAX, -1);
+    if (n < 0)
+      {
+      if (errno == EINTR) continue;
+      mylog_error ("epoll_wait failed: %s", strerror (errno));
+      return -1;
+      }
+    for (int i = 0; i < n && !quit; i++)
+      {
+      EvWatch *w = events[i].data.ptr;
+      // The watch might have been removed by an earlier handler
+      if (w->fd >= 0) w->handler (w->fd, events[i].events, w->data);
+      }
+    }
+  return 0;
+  }
+
+/**
+  evloop_quit
+
+  Make evloop_run() return, once the current handler has finished.
+*/
+void evloop_quit (void)
+  {
+  quit = TRUE;
+  }
+
+/**
+  evloop_done
+
+  Close the epoll instance. The watched descriptors belong to the callers,
+and are not closed.
+*/
+void evloop_done (void)
+  {
+  if (epoll_fd >= 0) close (epoll_fd);
+  epoll_fd = -1;
+  }
+
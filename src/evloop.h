@@ -0,0 +1,24 @@
+/*=============================================================================
+
+  p53-fan
+  evloop.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+// A handler is called with the descriptor that is ready, the epoll events
+//   that made it ready, and the data pointer supplied to evloop_add()
+typedef void (*EvHandler) (int fd, unsigned events, void *data);
+
+extern int evloop_init (void);
+extern int evloop_add (int fd, unsigned events, EvHandler handler, 
+         void *data);
+extern void evloop_remove (int fd);
+extern int evloop_run (void);
+extern void evloop_quit (void);
+extern void evloop_done (void);
+
@@ -13,14 +13,77 @@
 #include <string.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "config.h" 
 #include "mylog.h" 
 #include "fan.h" 
 
+// The fan control pseudo-file stays open from fan_to_manual() to 
+//   fan_to_auto(), so we can read the fan state back cheaply
+static int fan_fd = -1;
+
+// The level we last wrote, or -1 if we haven't written one yet. This is
+//   also the simulated fan level in dry-run mode.
+static int last_level = -1;
+
+static FanStats stats;
+
+// Descriptors on the fanN_input files of the thinkpad hwmon device, which
+//   give the speed of each fan
+static int speed_fds[FAN_SPEEDS_MAX];
+static int nspeeds = 0;
+
+// TRUE if the fan control file is an ordinary file, as in a test fixture,
+//   rather than the driver's pseudo-file
+static BOOL fan_is_file = FALSE;
+
+// Normally FAN_FILE, but can be changed for testing
+static const char *fan_file = FAN_FILE;
+
+/**
+  emulate_write
+
+  Apply a write to an ordinary file the way the thinkpad_acpi driver 
+applies it to /proc/acpi/ibm/fan: the file keeps its other lines, and only
+the 'level:' line changes. 'enable' is the same as 'level auto', and 
+'disable' as 'level 0'. Without this, a test fixture would just collect
+the writes, and the level could never be read back.
+*/
+static int emulate_write (int f, const char *text)
+  {
+  const char *level = text;
+  if (strcmp (text, "enable") == 0) level = "auto";
+  else if (strcmp (text, "disable") == 0) level = "0";
+  else if (strncmp (text, "level ", 6) == 0) level = text + 6;
+  else return 0; // The driver accepts other commands, e.g., 'watchdog'
+
+  char old[512], result[600];
+  int n = pread (f, old, sizeof (old) - 1, 0);
+  if (n < 0) return -1;
+  old[n] = 0;
+  // Keep what comes before and after the level line
+  char *p = strstr (old, "level:");
+  const char *rest = "";
+  if (p)
+    {
+    char *eol = strchr (p, '\n');
+    if (eol) rest = eol + 1;
+    }
+  else
+    p = old + n;
+  int len = snprintf (result, sizeof (result), "%.*slevel:\t\t%s\n%s", 
+    (int)(p - old), old, level, rest);
+  if (len >= (int)sizeof (result)) return -1;
+  if (pwrite (f, result, len, 0) != len) return -1;
+  return ftruncate (f, len);
+  }
+
 /** 
   fan_write
   Write a string, then a terminating \n, to the fan control
-  pseudo-file /proc/acpi/ibm/fan.
+  pseudo-file /proc/acpi/ibm/fan. Every write is an EC transaction, so we
+  try not to do it unless something has to change.
 */
 static int fan_write (const char *text, BOOL dry_run)
   {
@@ -32,21 +95,150 @@ static int fan_write (const char *text, BOOL dry_run)
   char s[32];
   strcpy (s, text);
   strcat (s, "\n");
-  int ret = -1;
-  int f = open (FAN_FILE, O_WRONLY);
-  if (f >= 0)
+  int f = fan_fd >= 0 ? fan_fd : open (fan_file, O_WRONLY);
+  if (f < 0)
     {
-    int n = write (f, s, strlen (s));
-    mylog_trace ("write() returned %d", n);
-    close (f);
-    ret = 0;
+    mylog_error ("Can't open '%s' for writing", fan_file);
+    return -1;
     }
-  else
+  int n = fan_is_file && f == fan_fd ? emulate_write (f, text) 
+    : write (f, s, strlen (s));
+  mylog_trace ("write() returned %d", n);
+  if (f != fan_fd) close (f);
+  stats.writes++;
+  if (n < 0)
     {
-    ret = -1;
-    mylog_error ("Can't open '%s' for writing", FAN_FILE);
+    mylog_error ("Can't write '%s' to '%s': %s", text, fan_file, 
+      strerror (errno));
+    return -1;
     }
-  return ret;
+  return 0;
+  }
+
+/**
+  fan_get_level
+  Read the current fan level from the 'level:' line of the fan control
+pseudo-file. 'disengaged' and 'full-speed' are both reported as FAN_MAX.
+Returns FAN_AUTO if the fan is under firmware control, or -1 if the level
+can't be read.
+*/
+int fan_get_level (void)
+  {
+  if (fan_fd < 0) return -1;
+  char buff[512];
+  int n = pread (fan_fd, buff, sizeof (buff) - 1, 0);
+  if (n <= 0) return -1;
+  buff[n] = 0;
+  char *p = strstr (buff, "level:");
+  if (!p) return -1;
+  p += 6;
+  while (*p == ' ' || *p == '\t') p++;
+  if (strncmp (p, "auto", 4) == 0) return FAN_AUTO;
+  if (strncmp (p, "disengaged", 10) == 0) return FAN_MAX;
+  if (strncmp (p, "full-speed", 10) == 0) return FAN_MAX;
+  if (*p >= '0' && *p <= '7') return *p - '0';
+  return -1;
+  }
+
+/**
+  fan_get_speed
+  Read the fan speed, in RPM, from the 'speed:' line of the fan control
+pseudo-file. Returns -1 if the speed can't be read, which is always the 
+case in dry-run mode.
+*/
+static int fan_get_speed (void)
+  {
+  if (fan_fd < 0) return -1;
+  char buff[512];
+  int n = pread (fan_fd, buff, sizeof (buff) - 1, 0);
+  if (n <= 0) return -1;
+  buff[n] = 0;
+  char *p = strstr (buff, "speed:");
+  if (!p) return -1;
+  char *end;
+  long speed = strtol (p + 6, &end, 10);
+  if (end == p + 6 || speed < 0) return -1;
+  return (int)speed;
+  }
+
+/**
+  fan_open_speeds
+
+  Find the thinkpad hwmon device under hwmon_root, and open the fanN_input
+file of each fan it reports. The 'speed:' line of the fan control file only
+gives the first fan, but models like the P53 have two. A fan whose file 
+can't be read now is assumed not to be fitted. Returns the number of fans
+found, which is zero if the thinkpad device has no fan files; then 
+fan_get_speeds() falls back to the 'speed:' line.
+*/
+int fan_open_speeds (const char *hwmon_root)
+  {
+  DIR *d = opendir (hwmon_root);
+  if (!d) return 0;
+  struct dirent *de;
+  while ((de = readdir (d)) && nspeeds == 0)
+    {
+    if (de->d_name[0] == '.') continue;
+    char path[PATH_MAX], name[32];
+    snprintf (path, sizeof (path), "%s/%s/name", hwmon_root, de->d_name);
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+    int n = read (fd, name, sizeof (name) - 1);
+    close (fd);
+    if (n <= 0) continue;
+    name[n] = 0;
+    name[strcspn (name, "\n")] = 0;
+    if (strcmp (name, "thinkpad") != 0) continue;
+    for (int i = 1; i <= FAN_SPEEDS_MAX; i++)
+      {
+      snprintf (path, sizeof (path), "%s/%s/fan%d_input", hwmon_root, 
+        de->d_name, i);
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) continue;
+      char buff[32];
+      if (pread (fd, buff, sizeof (buff), 0) <= 0)
+        {
+        close (fd);
+        continue;
+        }
+      speed_fds[nspeeds++] = fd;
+      }
+    if (nspeeds > 0)
+      mylog_info ("Reading the speed of %d fans from '%s/%s'", nspeeds, 
+        hwmon_root, de->d_name);
+    }
+  closedir (d);
+  return nspeeds;
+  }
+
+/**
+  fan_get_speeds
+
+  Read the speed of each fan, in RPM, into speeds, which has room for 
+FAN_SPEEDS_MAX. A fan whose speed can't be read is given as -1. Returns the
+number of fans, or zero in dry-run mode, when the speeds mean nothing.
+*/
+int fan_get_speeds (int *speeds)
+  {
+  if (fan_fd < 0) return 0;
+  if (nspeeds == 0)
+    {
+    speeds[0] = fan_get_speed ();
+    return 1;
+    }
+  for (int i = 0; i < nspeeds; i++)
+    {
+    char buff[32];
+    int n = pread (speed_fds[i], buff, sizeof (buff) - 1, 0);
+    if (n > 0)
+      {
+      buff[n] = 0;
+      speeds[i] = atoi (buff);
+      }
+    else
+      speeds[i] = -1;
+    }
+  return nspeeds;
   }
 
 /**
@@ -54,18 +246,59 @@ static int fan_write (const char *text, BOOL dry_run)
   Set the fan level from 0-8. We do this by writing 'level N' to the fan
 control pseudo-file. Level 8, however, is an interval level used by this
 program, and not the fan driver. We translate level 8 to 'disengaged'.
+
+  We only write the level if the fan isn't already at that level, so there's
+one EC write per change of level. However, we read the level back on every 
+call, in case something else has changed it. If something has, we count it,
+and put the level back. 
 */
 void fan_set_level (int new_level, BOOL dry_run)
   {
+  int actual = dry_run ? last_level : fan_get_level ();
+  if (last_level >= 0 && actual >= 0 && actual != last_level)
+    {
+    stats.tampers++;
+    mylog_warn ("Fan level changed to %d by something else (%d times)", 
+      actual, stats.tampers);
+    }
+  if (actual == new_level)
+    {
+    stats.skipped++;
+    return;
+    }
+
   mylog_debug ("Setting fan level %d", new_level);
+  int ret;
   if (new_level == FAN_MAX)
-    fan_write ("level disengaged", dry_run);
+    ret = fan_write ("level disengaged", dry_run);
   else
     {
     char s[32];
     snprintf (s, sizeof (s), "level %d", new_level);
-    fan_write (s, dry_run);
+    ret = fan_write (s, dry_run);
     }
+  last_level = (ret == 0) ? new_level : -1;
+  }
+
+/**
+  fan_set_file
+
+  Use a different fan control file from FAN_FILE. This must be called before
+fan_to_manual().
+*/
+void fan_set_file (const char *file)
+  {
+  fan_file = file;
+  }
+
+/**
+  fan_get_stats
+  Get counts of EC writes, skipped writes, and external changes of fan
+level, since the program started.
+*/
+void fan_get_stats (FanStats *fan_stats)
+  {
+  *fan_stats = stats;
   }
 
 /**
@@ -82,6 +315,12 @@ int fan_to_auto (BOOL dry_run)
     mylog_error ("Can't set fan to automatic");
   else
     mylog_info ("Fan control enabled");
+  if (fan_fd >= 0) close (fan_fd);
+  fan_fd = -1;
+  last_level = -1;
+  for (int i = 0; i < nspeeds; i++)
+    close (speed_fds[i]);
+  nspeeds = 0;
   return ret;
   }
 
@@ -94,6 +333,17 @@ even if the user has permissions to write the relevant pseudo-file.
 int fan_to_manual (BOOL dry_run)
   {
   mylog_debug ("Trying to set fan to programatic");
+  if (!dry_run)
+    {
+    fan_fd = open (fan_file, O_RDWR | O_CLOEXEC);
+    if (fan_fd < 0)
+      {
+      mylog_error ("Can't open '%s' for writing", fan_file);
+      return -1;
+      }
+    struct stat sb;
+    fan_is_file = (fstat (fan_fd, &sb) == 0 && S_ISREG (sb.st_mode));
+    }
   int ret = 0;
   ret |= fan_write ("disable", dry_run);
   // We have to set some initial fan speed, and there's no way to know what it
@@ -101,10 +351,16 @@ int fan_to_manual (BOOL dry_run)
   //   default fan control.
   if (ret == 0) ret |= fan_write ("level 3", dry_run);
   if (ret)
+    {
     mylog_error ("Can't set fan to programatic");
+    if (fan_fd >= 0) close (fan_fd);
+    fan_fd = -1;
+    }
   else
+    {
     mylog_info ("Fan control enabled");
+    last_level = 3;
+    }
   return ret;
   }
 
-
@@ -14,8 +14,24 @@
 // use level '8' internally to represent 'disengaged' fan operation.
 #define FAN_MIN 0
 #define FAN_MAX 8
+// Reported by fan_get_level() when the firmware is controlling the fan
+#define FAN_AUTO 100
+// The most fans whose speed we check. The P53 has two, which share a level.
+#define FAN_SPEEDS_MAX 4
+
+typedef struct _FanStats
+  {
+  unsigned int writes; // Number of EC writes
+  unsigned int skipped; // Number of times the level was already right
+  unsigned int tampers; // Number of times something else changed the level
+  } FanStats;
 
 extern int fan_to_auto (BOOL dry_run);
 extern int fan_to_manual (BOOL dry_run);
 extern void fan_set_level (int new_level, BOOL dry_run);
+extern int fan_get_level (void);
+extern int fan_open_speeds (const char *hwmon_root);
+extern int fan_get_speeds (int *speeds);
+extern void fan_set_file (const char *file);
+extern void fan_get_stats (FanStats *fan_stats);
 
@@ -19,63 +19,31 @@
 #include "defs.h" 
 #include "config.h" 
 #include "mylog.h" 
+#include "uring.h" 
 #include "hwmon_scan.h" 
 
-/**
-  should_include
-
-  Decide what metrics to include in the calculation of maximum temperature.
-  This function takes the driver name and the label -- that is, the
-  contents of the file inputNN_label that is alongside inputNN_temp. Not all
-  hwmon drivers use labels.
-
-  This method returns TRUE if the metric should be included.
-*/
-static BOOL should_include (const char *driver, const char *label, 
-         const HSContext *context)
-  {
-  // Include the wifi adapter
-  if (!context->nowifi && strncmp (driver, "iwlwifi", 7) == 0) return TRUE; 
-  // Include all the CPU cores
-  if (strncmp (driver, "coretemp", 8) == 0) return TRUE; 
-  // Include the CPU and GPU figures from thinkpad_acpi
-  if (strncmp (driver, "thinkpad", 8) == 0)
-    {
-    if (strncmp (label, "CPU", 3)== 0) return TRUE; 
-    if (strncmp (label, "GPU", 3)== 0) return TRUE; 
-    }
-  // Include NVME drives, but just the 'composite' figure
-  if (strncmp (driver, "nvme", 4) == 0)
-    {
-    if (strncmp (label, "Composite", 9)== 0) return TRUE; 
-    }
-  // Include drives exposed using the drivetemp kernel module. These are
-  //   usually SATA drives.
-  if (!context->nodrivetemp && strncmp (driver, "drivetemp", 9) == 0) return TRUE;
-  return FALSE;
-  }
-
 /**
   read_pseudo_file
 
-  Read a specific pseudo-file into memory. This function is used to read the
-metric names from tempNN_label and the temperatures themselves from
-tempNN_input.  Both will be short strings, and can be read in a single call to
-read().
+  Read a specific pseudo-file, relative to an open hwmon directory, into
+memory. This function is used to read the driver name from 'name' and the
+metric names from tempNN_label, during discovery. Both will be short strings,
+and can be read in a single call to read().
 */
-static int read_pseudo_file (const char *filename, char *result, int len)
+static int read_pseudo_file (int dirfd, const char *filename, char *result, 
+         int len)
   {
   mylog_trace ("Reading pseudofile '%s'", filename);
-  int f = open (filename, O_RDONLY);
+  int f = openat (dirfd, filename, O_RDONLY);
   if (f >= 0)
     {
-    int n = read (f, result, len);
+    int n = read (f, result, len - 1);
     close (f);
     if (n > 0)
       {
       result[n] = 0;
       int l = strlen (result);
-      if (result[l - 1] == 10)
+      if (l > 0 && result[l - 1] == 10)
         result[l - 1] = 0;
       return 0;
       }
@@ -90,168 +58,809 @@ static int read_pseudo_file (const char *filename, char *result, int len)
   }
 
 /**
-  do_file 
+  track_sensor
+
+  Open a sensor's tempNN_input file, and add it to the sensor table. The 
+descriptor stays open until the table is rebuilt. Returns -1 if the file
+can't be opened.
+*/
+static int track_sensor (HSContext *context, int device, const char *file,
+         const char *label, int offset)
+  {
+  const HSDevice *dev = &context->devices[device];
+  int fd = openat (dev->dirfd, file, O_RDONLY);
+  if (fd < 0)
+    {
+    mylog_warn ("Can't open '%s/%s': %s", dev->path, file, strerror (errno));
+    return -1;
+    }
+
+  HSSensor *sensors = realloc (context->sensors, 
+    (context->nsensors + 1) * sizeof (HSSensor));
+  if (!sensors)
+    {
+    close (fd);
+    return -1;
+    }
+  context->sensors = sensors;
+  HSSensor *s = &sensors[context->nsensors++];
+  s->device = device;
+  s->fd = fd;
+  s->temp = -273;
+  s->offset = offset;
+  s->have_temp = FALSE;
+  s->failures = 0;
+  s->last_read = 0;
+  // NVME and SATA drives are slow to read, and reading them can stop them
+  //   going into low-power states, so we read them less often
+  s->slow = (strncmp (dev->driver, "nvme", 4) == 0 
+    || strncmp (dev->driver, "drivetemp", 9) == 0);
+  memset (&s->read_time, 0, sizeof (s->read_time));
+  strncpy (s->label, label[0] ? label : "?", sizeof (s->label));
+  s->label[sizeof (s->label) - 1] = 0;
+  strncpy (s->file, file, sizeof (s->file));
+  s->file[sizeof (s->file) - 1] = 0;
+  char path[PATH_MAX];
+  snprintf (path, sizeof (path), "%s/%s", dev->path, file);
+  strncpy (s->path, path, sizeof (s->path));
+  s->path[sizeof (s->path) - 1] = 0;
+  mylog_debug ("Tracking sensor '%s:%s' (%s), offset %d", dev->driver, 
+    s->label, s->path, offset);
+  return 0;
+  }
+
+/**
+  add_sensor
 
-  This function is called for every file under /sys/class/hwmon. It ignores
-files that don't match 'temp*_input' -- these are the temperature metrics.
-For each matching file it reads tempNN_label to get the sensor name, then
-calls should_include() to determine whether this is a sensor whose temperature
-should be included. If it is, we use it to work out the maximum temperature
-for the current poll.
+  Consider a single file in a hwmon device directory. We ignore files that
+don't match 'temp*_input' -- these are the temperature metrics. For each
+matching file we read tempNN_label to get the sensor name, then check the
+sensor rules to determine whether this is a sensor whose temperature
+should be included. If it is, we add it to the sensor table. link is the
+device's absolute path under /sys/devices, which the rules can match.
+*/
+static void add_sensor (HSContext *context, int device, const char *file,
+         const char *link)
+  {
+  if (strncmp (file, "temp", 4) != 0) return;
+  const char *p = strrchr (file, '_');
+  if (!p || strcmp (p, "_input") != 0) return;
 
-  This function records the driver and sensor name for the maximum
-temperature, but this information is used only for logging -- p53-fan doesn't
-care where its temperatures come from, as they are all treated the same. 
+  const HSDevice *dev = &context->devices[device];
+  char label_file[64];
+  snprintf (label_file, sizeof (label_file), "%.*s_label", 
+    (int)(p - file), file);
+  char label[32];
+  label[0] = 0;
+  if (read_pseudo_file (dev->dirfd, label_file, label, sizeof (label)) != 0)
+    mylog_trace ("Label file '%s/%s' does not exist", dev->path, label_file);
+  // The absence of a label file does not stop us including the
+  //   temperature
+  const SensorRule *rule = rules_match (&context->rules, dev->driver, label, 
+    link);
+  if (!rule || !rule->include) return;
+  track_sensor (context, device, file, label, rule->offset);
+  }
+
+/**
+  device_identity
+
+  Get the target of the /sys/class/hwmon/hwmonNN symlink, e.g., 
+'../../devices/platform/coretemp.0/hwmon/hwmon3'. This tells us which 
+physical device a hwmon number belongs to, which the number alone does not.
+If the entry isn't a symlink (as in a test tree), the identity is '-'.
+*/
+static void device_identity (int rootfd, const char *name, char *result, 
+         int len)
+  {
+  int n = readlinkat (rootfd, name, result, len - 1);
+  if (n <= 0) n = snprintf (result, len, "-");
+  result[n] = 0;
+  }
+
+/**
+  open_device
+
+  Open a directory under /sys/class/hwmon, and add it to the device table,
+without looking for sensors. Returns the new device's index, or -1 if the 
+directory can't be opened. A device that can't be opened is not an error. 
+We just assume that the directory corresponds to some driver that hasn't yet 
+initialized fully.
+*/
+static int open_device (HSContext *context, const char *name)
+  {
+  char path[256];
+  snprintf (path, sizeof (path), "%s/%s", context->root, name);
+  int dirfd = open (path, O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0)
+    {
+    mylog_warn ("Can't open  directory '%s': %s", path, strerror (errno));
+    return -1;
+    }
+
+  HSDevice *devices = realloc (context->devices, 
+    (context->ndevices + 1) * sizeof (HSDevice));
+  if (!devices)
+    {
+    close (dirfd);
+    return -1;
+    }
+  context->devices = devices;
+  int device = context->ndevices++;
+  HSDevice *dev = &devices[device];
+  context->generation++;
+  dev->dirfd = dirfd;
+  dev->stale = FALSE;
+  strncpy (dev->name, name, sizeof (dev->name));
+  dev->name[sizeof (dev->name) - 1] = 0;
+  strcpy (dev->path, path);
+  if (read_pseudo_file (dirfd, "name", dev->driver, sizeof (dev->driver)) != 0)
+    strcpy (dev->driver, "?");
+  return device;
+  }
+
+/**
+  add_device
+  
+  Add a hwmon device, and all its matching sensors, to the sensor table. Be 
+aware that the device directories are likely to be symlinks, so we can't use 
+the d_type field in struct dirent to distinguish files from directories: we 
+need to call fstatat() explicitly. 
+
+  So far as I know, there's never a need to descend further than these
+directories to find all the tempNN_input files. In fact, trying to do so
+will fail horribly, as there are circular links in the tree.  
 */
-static void do_file (const char *driver, const char *path, HSContext *context)
+static void add_device (HSContext *context, const char *name)
   {
-  if (strstr (path, "/temp"))
+  int device = open_device (context, name);
+  if (device < 0) return;
+  int dirfd = context->devices[device].dirfd;
+  // The rules match the physical device, which the hwmon number doesn't
+  //   identify: the absolute path that the hwmonNN link resolves to, e.g., 
+  //   /sys/devices/platform/coretemp.0/hwmon/hwmon3. In a test tree, which
+  //   has no symlinks, that's just the directory itself.
+  char link[PATH_MAX];
+  if (!realpath (context->devices[device].path, link))
+    strcpy (link, context->devices[device].path);
+
+  int first_sensor = context->nsensors;
+  DIR *d = fdopendir (dup (dirfd));
+  if (d)
     {
-    if (strstr (path, "_input"))
+    struct dirent *de;
+    while ((de = readdir (d)))
       {
-      char label_file[PATH_MAX];
-      strcpy (label_file, path);
-      char *p = strrchr (label_file, '_');
-      if (p)
+      if (de->d_name[0] == '.') continue; 
+      struct stat sb;
+      if (fstatat (dirfd, de->d_name, &sb, 0) == 0)
         {
-        strcpy (p, "_label");
-        //printf ("file=%s\n", path);
-        char label[32];
-        label[0] = 0;
-        //printf ("label=%s\n", label_file);
-        char *current_label;
-        if (read_pseudo_file (label_file, label, sizeof (label)) == 0)
-          current_label = label; 
-        else
-          {
-          current_label = "?";
-          mylog_trace ("Label file '%s' does not exist", label_file);
-          }
-        // The absence of a label file does not stop us including the
-        //temperature
-        if (should_include (driver, label, context))
-          {
-          context->valid = TRUE; // Indicate that we got at least one 
-                                 //   matching sensor in this poll
-	  char temp_string[30];
-	  if (read_pseudo_file (path, temp_string, sizeof (temp_string)) == 0)
-	    {
-	    // Got a temperature
-	    int temp = atoi (temp_string) / 1000;
-	    mylog_debug ("Sensor '%s:%s:(%s)' has temperature %d", 
-	      driver, current_label, path, temp);
-	    if (temp > context->max_temp)
-	      {
-	      // If this is the maximum temperature so far, record information
-	      // about it for logging.
-	      strncpy (context->driver, driver, sizeof (context->driver));
-	      strncpy (context->label, label, sizeof (context->label));
-	      strncpy (context->path, path, sizeof (context->path));
-	      context->path[sizeof(context->path) - 1] = 0;
-	      context->max_temp = temp;
-	      }
-	    }
-          }
+        if (!S_ISDIR (sb.st_mode))
+          add_sensor (context, device, de->d_name, link);
         }
+      else
+        mylog_warn ("Can't stat '%s/%s': %s", context->devices[device].path, 
+          de->d_name, strerror (errno));
       }
+    closedir (d);
+    }
+
+  // Don't keep devices that have no sensors we're interested in
+  if (context->nsensors == first_sensor)
+    {
+    close (dirfd);
+    context->ndevices--;
     }
   }
 
 /**
-  do_dir
-  
-  Enumerate a directory under /sys/class/hwmon. Be aware that these
-directories are likely to be symlinks, so we can't use the d_type field in
-struct dirent to distinguish files from directories: we need to call stat()
-explicitly.
+  remove_device
 
-  So far as I know, there's never a need to descend more than one level of the
-directory tree, to find all the tempNN_input files. In fact, trying to do so
-will fail horribly, as there are circular links in the tree.  
+  Remove a device, and all its sensors, from the table, closing their
+descriptors. The remaining devices move down to fill the gap, so we have
+to renumber the sensors' device indices.
+*/
+static void remove_device (HSContext *context, int device)
+  {
+  context->generation++;
+  int j = 0;
+  for (int i = 0; i < context->nsensors; i++)
+    {
+    HSSensor *s = &context->sensors[i];
+    if (s->device == device)
+      {
+      close (s->fd);
+      continue;
+      }
+    if (s->device > device) s->device--;
+    context->sensors[j++] = *s;
+    }
+  context->nsensors = j;
+  close (context->devices[device].dirfd);
+  memmove (&context->devices[device], &context->devices[device + 1],
+    (context->ndevices - device - 1) * sizeof (HSDevice));
+  context->ndevices--;
+  }
+
+/**
+  find_device
 
-  do_dir won't fail if a directory can't be opened, unless it's the very
-top-level directory /sys/class/hwmon. It just assumes that the absent
-directory corresponds to some driver that hasn't yet initialized fully. But if
-/sys/class/hwmon itself is absent, something is very wrong.
+  Return the index of the device with the specified name, e.g., hwmon3, or -1
+if it is not in the table.
 */
-static int do_dir (int level, const char *full_path, HSContext *context)
+static int find_device (const HSContext *context, const char *name)
   {
-  int ret = 0;
-  char name[32];
-  char name_file[PATH_MAX];
+  for (int i = 0; i < context->ndevices; i++)
+    if (strcmp (context->devices[i].name, name) == 0) return i;
+  return -1;
+  }
+
+/**
+  clear_table
+
+  Close all the descriptors held by the sensor table, and empty it. 
+*/
+static void clear_table (HSContext *context)
+  {
+  context->generation++;
+  for (int i = 0; i < context->nsensors; i++)
+    close (context->sensors[i].fd);
+  for (int i = 0; i < context->ndevices; i++)
+    close (context->devices[i].dirfd);
+  context->nsensors = 0;
+  context->ndevices = 0;
+  }
+
+/**
+  discover
+
+  Enumerate /sys/class/hwmon, and build a new sensor table from scratch. This
+is the only place where we walk the whole directory tree; polls just read the
+descriptors that discover() leaves open. If /sys/class/hwmon itself is absent,
+something is very wrong, and we return -1.
+*/
+static int discover (HSContext *context)
+  {
+  clear_table (context);
+  context->stale = FALSE;
+  context->polls_since_discovery = 0;
+
+  DIR *d = opendir (context->root);
+  if (!d)
+    {
+    mylog_warn ("Can't open  directory '%s': %s", context->root, 
+      strerror (errno));
+    context->stale = TRUE;
+    return -1;
+    }
+  struct dirent *de;
+  while ((de = readdir (d)))
+    {
+    if (de->d_name[0] == '.') continue; 
+    struct stat sb;
+    if (fstatat (dirfd (d), de->d_name, &sb, 0) == 0 && S_ISDIR (sb.st_mode))
+      add_device (context, de->d_name);
+    }
+  closedir (d);
+
+  mylog_info ("Discovered %d sensors on %d hwmon devices", 
+    context->nsensors, context->ndevices);
+  return 0;
+  }
+
+/**
+  save_manifest
 
-  const char *current_name;
-  strcpy (name_file, full_path);
-  strcat (name_file, "/name");
-  if (read_pseudo_file (name_file, name, sizeof (name)) == 0)
-    current_name = name;
+  Write the sensor table to the manifest file, so the next start can skip
+discovery. As well as the devices and sensors in the table, we list the 
+hwmon devices that had no sensors we're interested in, so that load_manifest()
+can tell when a device has appeared. The file is written under a temporary
+name and renamed, so a reader never sees half a manifest.
+*/
+static void save_manifest (HSContext *context)
+  {
+  context->saved_generation = context->generation;
+  if (!context->manifest) return;
+  char temp_file[PATH_MAX];
+  snprintf (temp_file, sizeof (temp_file), "%s.tmp", context->manifest);
+  FILE *f = fopen (temp_file, "w");
+  DIR *d = opendir (context->root);
+  if (!f || !d)
+    {
+    mylog_debug ("Can't write sensor manifest '%s': %s", temp_file, 
+      strerror (errno));
+    if (f) fclose (f);
+    if (d) closedir (d);
+    return;
+    }
+
+  fprintf (f, "# p53-fan sensor manifest -- rebuilt automatically\n");
+  fprintf (f, "root %s\n", context->root);
+  fprintf (f, "rules %08x\n", context->rules.hash);
+  char identity[256];
+  struct dirent *de;
+  while ((de = readdir (d)))
+    {
+    if (de->d_name[0] == '.') continue; 
+    device_identity (dirfd (d), de->d_name, identity, sizeof (identity));
+    int device = find_device (context, de->d_name);
+    if (device < 0)
+      {
+      fprintf (f, "ignore %s %s\n", de->d_name, identity);
+      continue;
+      }
+    fprintf (f, "device %s %s %s\n", de->d_name, 
+      context->devices[device].driver, identity);
+    for (int i = 0; i < context->nsensors; i++)
+      {
+      const HSSensor *s = &context->sensors[i];
+      if (s->device == device) 
+        fprintf (f, "sensor %s %d %s\n", s->file, s->offset, s->label);
+      }
+    }
+  closedir (d);
+
+  if (fclose (f) != 0 || rename (temp_file, context->manifest) != 0)
+    {
+    mylog_debug ("Can't write sensor manifest '%s': %s", context->manifest, 
+      strerror (errno));
+    unlink (temp_file);
+    }
+  }
+
+/**
+  load_manifest
+
+  Build the sensor table from the manifest written by an earlier run, rather
+than by walking the hwmon tree. The manifest is only used if it was written
+for the same hwmon root and the same sensor rules, the set of hwmon 
+devices hasn't changed, each device still belongs to the same driver and
+physical device, and every sensor file can still be opened. The checks cost 
+one readlink() per device and one open() per sensor, which we'd have to do
+anyway. Returns -1, with the table empty, if the manifest can't be used.
+*/
+static int load_manifest (HSContext *context)
+  {
+  if (!context->manifest) return -1;
+  FILE *f = fopen (context->manifest, "r");
+  if (!f) return -1;
+  int rootfd = open (context->root, O_RDONLY | O_DIRECTORY);
+  if (rootfd < 0)
+    {
+    fclose (f);
+    return -1;
+    }
+
+  uint64_t start = stats_now ();
+  BOOL ok = TRUE;
+  int names = 0; // hwmon devices listed, whether or not we use them
+  int device = -1;
+  char line[512];
+  while (ok && fgets (line, sizeof (line), f))
+    {
+    line[strcspn (line, "\n")] = 0;
+    if (line[0] == '#' || line[0] == 0) continue;
+    char *arg = strchr (line, ' ');
+    if (!arg) { ok = FALSE; break; }
+    *arg++ = 0;
+    char name[32], driver[32], link[256], identity[256];
+    if (strcmp (line, "root") == 0)
+      ok = (strcmp (arg, context->root) == 0);
+    else if (strcmp (line, "rules") == 0)
+      {
+      unsigned hash;
+      ok = (sscanf (arg, "%x", &hash) == 1 && hash == context->rules.hash);
+      }
+    else if (strcmp (line, "ignore") == 0)
+      {
+      ok = (sscanf (arg, "%31s %255s", name, link) == 2);
+      if (ok) device_identity (rootfd, name, identity, sizeof (identity));
+      ok = ok && strcmp (link, identity) == 0;
+      names++;
+      }
+    else if (strcmp (line, "device") == 0)
+      {
+      ok = (sscanf (arg, "%31s %31s %255s", name, driver, link) == 3);
+      if (ok) device_identity (rootfd, name, identity, sizeof (identity));
+      ok = ok && strcmp (link, identity) == 0;
+      if (ok) device = open_device (context, name);
+      ok = ok && device >= 0 
+        && strcmp (context->devices[device].driver, driver) == 0;
+      names++;
+      }
+    else if (strcmp (line, "sensor") == 0)
+      {
+      char file[32];
+      int offset, n = 0;
+      ok = (sscanf (arg, "%31s %d %n", file, &offset, &n) == 2 && n > 0);
+      ok = ok && device >= 0 
+        && track_sensor (context, device, file, arg + n, offset) == 0;
+      }
+    else
+      ok = FALSE;
+    }
+  fclose (f);
+
+  // A device that has appeared since the manifest was written would not
+  //   be listed in it
+  if (ok)
+    {
+    DIR *d = fdopendir (rootfd);
+    rootfd = -1;
+    struct dirent *de;
+    while (d && (de = readdir (d)))
+      if (de->d_name[0] != '.') names--;
+    if (d) closedir (d);
+    ok = (names == 0 && context->nsensors > 0);
+    }
+  if (rootfd >= 0) close (rootfd);
+
+  if (!ok)
+    {
+    mylog_info ("Sensor manifest '%s' is out of date", context->manifest);
+    clear_table (context);
+    return -1;
+    }
+  context->stale = FALSE;
+  context->polls_since_discovery = 0;
+  context->saved_generation = context->generation;
+  mylog_info ("Loaded %d sensors on %d hwmon devices from '%s' in %lluus",
+    context->nsensors, context->ndevices, context->manifest, 
+    (unsigned long long)(stats_now () - start) / 1000);
+  return 0;
+  }
+
+/**
+  hwmon_device_added
+
+  Called when the kernel reports a new (or changed) hwmon device, e.g.,
+hwmon7. Only that device is read; the rest of the sensor table is untouched.
+*/
+void hwmon_device_added (HSContext *context, const char *name)
+  {
+  if (context->stale) return; // We'll pick it up in the next full discovery
+  int device = find_device (context, name);
+  if (device >= 0) remove_device (context, device);
+  int before = context->nsensors;
+  add_device (context, name);
+  mylog_info ("hwmon device '%s' added %d sensors", name, 
+    context->nsensors - before);
+  }
+
+/**
+  hwmon_device_removed
+
+  Called when the kernel reports that a hwmon device has gone away. Its
+sensors are dropped from the table.
+*/
+void hwmon_device_removed (HSContext *context, const char *name)
+  {
+  int device = find_device (context, name);
+  if (device < 0) return;
+  mylog_info ("hwmon device '%s' (%s) removed", name, 
+    context->devices[device].driver);
+  remove_device (context, device);
+  }
+
+/**
+  hwmon_init
+
+  Set up an empty sensor table for the hwmon tree at root (normally
+/sys/class/hwmon). The first call to hwmon_scan() will populate it.
+*/
+void hwmon_init (HSContext *context, const char *root)
+  {
+  memset (context, 0, sizeof (HSContext));
+  context->root = root;
+  context->stale = TRUE;
+  context->driver = "?";
+  context->label = "?";
+  context->path = "?";
+  }
+
+/**
+  hwmon_done
+
+  Release the sensor table, and all its descriptors.
+*/
+void hwmon_done (HSContext *context)
+  {
+  clear_table (context);
+  // Destroying the ring waits for any reads still in flight, so it has to 
+  //   happen before we free their buffers
+  uring_destroy (context->uring);
+  free (context->slots);
+  context->uring = NULL;
+  context->slots = NULL;
+  free (context->sensors);
+  free (context->devices);
+  context->sensors = NULL;
+  context->devices = NULL;
+  context->stale = TRUE;
+  rules_free (&context->rules);
+  }
+
+/**
+  sensor_due
+
+  Sensors that are expensive to read are read less often than the others, 
+and we use their last value in between. Returns TRUE if the sensor should be
+read in this poll.
+*/
+static BOOL sensor_due (const HSContext *context, const HSSensor *s, 
+         uint64_t now)
+  {
+  if (!s->slow || !s->have_temp) return TRUE;
+  return now - s->last_read >= (uint64_t)context->slow_period_ms * 1000000;
+  }
+
+/**
+  got_reading
+
+  Store the result of reading a sensor's tempNN_input file: n is the number of
+bytes read into buff, or zero or negative if the read failed.
+*/
+static void got_reading (HSContext *context, HSSensor *s, char *buff, int n, 
+         uint64_t now)
+  {
+  if (n > 0)
+    {
+    buff[n] = 0;
+    s->temp = atoi (buff) / 1000 + s->offset;
+    s->have_temp = TRUE;
+    s->failures = 0;
+    s->last_read = now;
+    mylog_debug ("Sensor '%s:%s:(%s)' has temperature %d", 
+      context->devices[s->device].driver, s->label, s->path, s->temp);
+    }
   else
-    current_name = "?";
+    {
+    // Most likely the driver has gone away, or is being reset. Carry on 
+    //   with the sensors we can read, and re-read this device next time.
+    //   If the sensor is simply dead, re-reading the device every poll
+    //   would cost as much as discovery, so we back off.
+    unsigned f = ++s->failures;
+    mylog_debug ("Can't read '%s' (%u failures)", s->path, f);
+    if (f <= HWMON_RETRY_POLLS_MAX ? (f & (f - 1)) == 0 
+        : f % HWMON_RETRY_POLLS_MAX == 0)
+      context->devices[s->device].stale = TRUE;
+    }
+  }
 
-  DIR *d = opendir (full_path);
-  if (d)
+/**
+  reread_device
+
+  Rebuild the table entries of one device, after one of its sensors failed.
+The sensors keep their failure counts, so a sensor that is still dead 
+after this doesn't make us re-read the device at the next poll.
+*/
+static void reread_device (HSContext *context, int device)
+  {
+  char name[32];
+  strcpy (name, context->devices[device].name);
+  int n = 0;
+  for (int i = 0; i < context->nsensors; i++)
+    if (context->sensors[i].device == device) n++;
+  struct { char file[32]; unsigned failures; } saved[n ? n : 1];
+  n = 0;
+  for (int i = 0; i < context->nsensors; i++)
     {
-    struct dirent *de = readdir (d);
-    while (de)
+    const HSSensor *s = &context->sensors[i];
+    if (s->device != device) continue;
+    strcpy (saved[n].file, s->file);
+    saved[n++].failures = s->failures;
+    }
+
+  remove_device (context, device);
+  add_device (context, name);
+
+  device = find_device (context, name);
+  if (device < 0) return;
+  for (int i = 0; i < context->nsensors; i++)
+    {
+    HSSensor *s = &context->sensors[i];
+    if (s->device != device) continue;
+    for (int j = 0; j < n; j++)
+      if (strcmp (s->file, saved[j].file) == 0) 
+        s->failures = saved[j].failures;
+    }
+  }
+
+/**
+  read_sensors_sync
+
+  Read all the sensors that are due, one pread() at a time.
+*/
+static void read_sensors_sync (HSContext *context, uint64_t now)
+  {
+  for (int i = 0; i < context->nsensors; i++)
+    {
+    HSSensor *s = &context->sensors[i];
+    if (!sensor_due (context, s, now)) continue;
+    char temp_string[HWMON_READ_MAX];
+    uint64_t start = stats_enabled ? stats_now () : 0;
+    int n = pread (s->fd, temp_string, sizeof (temp_string) - 1, 0);
+    if (stats_enabled) histogram_add (&s->read_time, stats_now () - start);
+    got_reading (context, s, temp_string, n, now);
+    }
+  }
+
+/**
+  read_sensors_uring
+
+  Read all the sensors that are due as a single io_uring batch, so one slow
+driver doesn't hold up the others, and we make one system call rather than
+one per sensor. We wait at most HWMON_URING_DEADLINE_MS for the batch. A
+sensor whose read hasn't completed by then is left out of this poll, and
+isn't read again until the read completes. A late result is stored as of
+the poll that asked for it, so it's too old to count as fresh for a fast
+sensor, and a slow sensor's value ages from when it was asked for.
+
+  Each sensor uses the read slot with the same index. The slots are never
+reallocated, because the kernel might still be writing into one. If the
+sensor table has changed since a read was submitted, its result is 
+discarded. Sensors beyond the number of slots are read with pread().
+*/
+static void read_sensors_uring (HSContext *context, uint64_t now)
+  {
+  for (int i = 0; i < context->nsensors; i++)
+    {
+    HSSensor *s = &context->sensors[i];
+    if (!sensor_due (context, s, now)) continue;
+    if (i < HWMON_URING_ENTRIES)
       {
-      if (de->d_name[0] != '.') 
+      HSReadSlot *slot = &context->slots[i];
+      if (slot->busy) continue; // Still waiting for the last read
+      uint64_t user_data = ((uint64_t)context->generation << 32) | i;
+      if (uring_prep_read (context->uring, s->fd, slot->buff, 
+          sizeof (slot->buff) - 1, user_data) == 0)
         {
-	char new_path[PATH_MAX];
-	strcpy (new_path, full_path);
-	strcat (new_path, "/"); 
-	strcat (new_path, de->d_name); 
-        struct stat sb;
-        if (stat (new_path, &sb) == 0)
-          {
-          if (S_ISDIR (sb.st_mode)) 
-            {
-	    mylog_trace ("Expanding directory '%s'", new_path);
-            if (level < 1) do_dir (level + 1, new_path, context);
-            }
-          else
-            {
-            do_file (current_name, new_path, context);
-            }
-          }
-        else
-          mylog_warn ("Can't stat directory '%s': %s", full_path, strerror (errno));
+        slot->busy = TRUE;
+        slot->poll = now;
+        slot->start = stats_enabled ? stats_now () : 0;
+        continue;
         }
-      de = readdir (d);
       }
-    closedir (d);
+    char temp_string[HWMON_READ_MAX];
+    int n = pread (s->fd, temp_string, sizeof (temp_string) - 1, 0);
+    got_reading (context, s, temp_string, n, now);
     }
-  else
+
+  uring_submit_wait (context->uring, HWMON_URING_DEADLINE_MS);
+
+  uint64_t user_data;
+  int res;
+  while (uring_reap (context->uring, &user_data, &res))
     {
-    mylog_warn ("Can't open  directory '%s': %s", full_path, strerror (errno));
-    // If this is the top-level directory, /sys/class/hwmon, then failing to
-    //   open it must be a fatal error
-    if (level == 0) ret = -1;
+    int i = (int)(user_data & 0xffffffff);
+    HSReadSlot *slot = &context->slots[i];
+    slot->busy = FALSE;
+    if ((unsigned)(user_data >> 32) != context->generation) continue;
+    HSSensor *s = &context->sensors[i];
+    if (stats_enabled) 
+      histogram_add (&s->read_time, stats_now () - slot->start);
+    got_reading (context, s, slot->buff, res, slot->poll);
     }
-  return ret;
+  }
+
+/**
+  hwmon_use_uring
+
+  Read sensors using io_uring from now on, if it's available. Returns 0 if
+it is.
+*/
+int hwmon_use_uring (HSContext *context)
+  {
+  context->uring = uring_create (HWMON_URING_ENTRIES);
+  if (!context->uring) return -1;
+  context->slots = calloc (HWMON_URING_ENTRIES, sizeof (HSReadSlot));
+  return 0;
   }
 
 /**
   hwmon_scan 
 
-  Scan the entire hwmon tree, reading temperatures that match our criteria.
-The results are stored in context, which also supplies settings that restrict
-the search. This method returns zero if it succeeds, which it almost certainly
-will. The only reason for it to fail is if /sys/class/hwmon does not exist, or
-it can't find even one valid temperature sensor thereunder.
+  Read the temperatures of all the sensors that match our criteria, and work
+out the maximum. The results are stored in context, which also supplies
+settings that restrict the search. 
+
+  The whole hwmon tree is only enumerated when the sensor table has to be
+built from scratch: on the first call, and when the settings change. If a
+sensor stops responding, only its own device is re-read, and less and less
+often if the sensor stays dead. Unless the caller
+reports hotplug events (see hwmon_device_added()), we also rebuild the table
+every HWMON_REDISCOVER_POLLS polls, to pick up drivers that initialize late. 
+In all other cases, a scan is just one pread() per sensor.
+
+  Storage sensors ('slow' sensors) are only read every slow_period_ms. In 
+between, their last value is used, unless it is more than HWMON_STALE_FACTOR
+periods old, which would mean that the sensor has stopped responding. All
+other sensors are read every time.
+
+  This method returns zero if it succeeds, which it almost certainly will. The
+only reason for it to fail is if /sys/class/hwmon does not exist, or it can't
+find even one valid temperature sensor thereunder.
+
+  This function records the driver and sensor name for the maximum
+temperature, but this information is used only for logging -- p53-fan doesn't
+care where its temperatures come from, as they are all treated the same. 
 */
 int hwmon_scan (HSContext *context, BOOL nowifi, BOOL nodrivetemp) 
   {
-  strcpy (context->driver, "?");
-  strcpy (context->label, "?");
-  strcpy (context->path, "?");
-  context->max_temp = -273; // Absolute zero :)
-  context->valid = FALSE;
+  if (nowifi != context->nowifi || nodrivetemp != context->nodrivetemp
+      || !context->rules.rules)
+    {
+    rules_compile (&context->rules, context->user_rules, nowifi, nodrivetemp);
+    context->stale = TRUE;
+    }
   context->nowifi = nowifi;
   context->nodrivetemp = nodrivetemp;
-  if (do_dir (0, HWMON_ROOT, context) != 0) return -1;
-  if (context->valid) return 0;
+  if (!context->hotplug && 
+      context->polls_since_discovery++ >= HWMON_REDISCOVER_POLLS)
+    context->stale = TRUE;
+  if (context->stale)
+    {
+    // At startup, try the table that the last run left behind
+    BOOL first = !context->manifest_tried;
+    context->manifest_tried = TRUE;
+    if (!first || load_manifest (context) != 0)
+      {
+      if (discover (context) != 0) return -1;
+      }
+    }
+  else
+    {
+    for (int i = context->ndevices - 1; i >= 0; i--)
+      {
+      if (context->devices[i].stale) reread_device (context, i);
+      }
+    }
+  if (context->generation != context->saved_generation)
+    save_manifest (context);
+
+  uint64_t now = stats_now ();
+  if (context->uring)
+    read_sensors_uring (context, now);
+  else
+    read_sensors_sync (context, now);
+
+  // A fast sensor's value has to come from this poll; a slow sensor's
+  //   can be a few sampling periods old, but no more
+  uint64_t stale_ns = (uint64_t)context->slow_period_ms * 1000000 
+    * HWMON_STALE_FACTOR;
+  const HSSensor *max_sensor = NULL;
+  context->max_temp = -273; // Absolute zero :)
+  for (int i = 0; i < context->nsensors; i++)
+    {
+    HSSensor *s = &context->sensors[i];
+    if (!s->have_temp) continue;
+    if (s->last_read != now && (!s->slow || now - s->last_read > stale_ns))
+      continue;
+    if (s->temp > context->max_temp)
+      {
+      context->max_temp = s->temp;
+      max_sensor = s;
+      }
+    }
+
+  // Indicate whether we got at least one matching sensor in this poll
+  context->valid = (max_sensor != NULL);
+  if (context->valid) 
+    {
+    // If this is the maximum temperature, record information about it for
+    //   logging.
+    context->driver = context->devices[max_sensor->device].driver;
+    context->label = max_sensor->label;
+    context->path = max_sensor->path;
+    return 0;
+    }
+  // Try again from scratch next time: the sensors we want might not be
+  //   ready yet
+  context->stale = TRUE;
+  context->driver = "?";
+  context->label = "?";
+  context->path = "?";
   mylog_warn ("No valid, matching sensors detected");
   return -1;
   }
 
-
@@ -1,7 +1,7 @@
 /*=============================================================================
 
   p53-fan
-  hwmon_scan.h 
+  hwmon_scan.h
   Copyright (c)2025 Kevin Boone, GPL3.0
 
 =============================================================================*/
@@ -9,18 +9,86 @@
 #pragma once
 
 #include "defs.h"
+#include "stats.h"
+#include "rules.h"
 
-typedef struct _HSContext
+// Longest text we expect to read from a tempNN_input file
+#define HWMON_READ_MAX 32
+
+// One hwmon device directory, e.g., /sys/class/hwmon/hwmon3. We keep the
+//   directory open, so sensor files can be opened relative to it.
+typedef struct _HSDevice
   {
-  int max_temp;
+  int dirfd;
+  BOOL stale; // TRUE if the device must be re-read before the next poll
+  char name[32]; // e.g., hwmon3
   char driver[32];
+  char path[256];
+  } HSDevice;
+
+// One temperature sensor that matched our criteria, with a descriptor on
+//   its tempNN_input file that stays open between polls.
+typedef struct _HSSensor
+  {
+  int device; // Index into the device table
+  int fd;
+  int temp;
+  int offset; // Added to the temperature read, from the sensor rules
+  BOOL have_temp; // FALSE until the sensor has been read successfully
+  unsigned failures; // The number of reads in a row that have failed
+  BOOL slow; // TRUE for sensors that are read less often than the others
+  uint64_t last_read; // When temp was read, in stats_now() nanoseconds
   char label[32];
+  char file[32]; // e.g., temp1_input
   char path[256];
+  Histogram read_time; // Only updated when stats_enabled is set
+  } HSSensor;
+
+// The buffer for an io_uring read of a sensor, which must stay put until the
+//   read completes
+typedef struct _HSReadSlot
+  {
+  char buff[HWMON_READ_MAX];
+  BOOL busy; // TRUE while a read is in flight
+  uint64_t poll; // The time of the poll that submitted the read
+  uint64_t start;
+  } HSReadSlot;
+
+struct _URing;
+
+typedef struct _HSContext
+  {
+  int max_temp;
+  const char *driver;
+  const char *label;
+  const char *path;
   BOOL nowifi;
   BOOL nodrivetemp;
-  BOOL valid; 
-  } HSContext; 
-
-extern int hwmon_scan (HSContext *context, BOOL nowifi, BOOL nodrivetemp); 
+  const SensorRules *user_rules; // From the rules file; may be NULL
+  SensorRules rules; // The user's rules, and the filters and built-in rules
+  int slow_period_ms; // How often to read slow sensors; 0 for every poll
+  BOOL valid;
+  // The sensor table, built by discovery and used by every poll
+  HSDevice *devices;
+  int ndevices;
+  HSSensor *sensors;
+  int nsensors;
+  const char *root; // Normally /sys/class/hwmon
+  BOOL stale; // TRUE if the table must be rebuilt before the next poll
+  BOOL hotplug; // TRUE if the caller reports devices that come and go
+  int polls_since_discovery;
+  unsigned generation; // Incremented whenever the table changes
+  const char *manifest; // Where to save the table; NULL for nowhere
+  unsigned saved_generation; // The table generation last saved
+  BOOL manifest_tried;
+  struct _URing *uring; // NULL unless we read sensors using io_uring
+  HSReadSlot *slots;
+  } HSContext;
 
+extern void hwmon_init (HSContext *context, const char *root);
+extern int hwmon_scan (HSContext *context, BOOL nowifi, BOOL nodrivetemp);
+extern int hwmon_use_uring (HSContext *context);
+extern void hwmon_device_added (HSContext *context, const char *name);
+extern void hwmon_device_removed (HSContext *context, const char *name);
+extern void hwmon_done (HSContext *context);
 
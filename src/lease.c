@@ -0,0 +1,96 @@
+/*=============================================================================
+
+  p53-fan
+  lease.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Cooling leases. A client of the control socket can ask for the fan to run
+  at a particular level or higher, either for a fixed time, or for as long
+  as it keeps its connection open. The fan level is then at least the 
+  highest of the active leases, whatever the curve says. There are only
+  ever a few leases, so they're kept in a small array.
+
+=============================================================================*/
+
+#include "defs.h"
+#include "mylog.h"
+#include "lease.h"
+
+/**
+  drop_lease
+
+  Remove the lease at index i, moving the last one into its place.
+*/
+static void drop_lease (Leases *leases, int i)
+  {
+  leases->leases[i] = leases->leases[leases->n - 1];
+  leases->n--;
+  }
+
+/**
+  lease_add
+
+  Add a lease for the given level. client is the control connection that
+holds the lease, or -1 if it lasts until expires. A connection holds at most
+one lease, so a new one replaces the old. Returns -1 if there are too many 
+leases already.
+*/
+int lease_add (Leases *leases, int client, int level, uint64_t expires)
+  {
+  if (client >= 0) lease_release (leases, client);
+  if (leases->n == LEASE_MAX)
+    {
+    mylog_warn ("Too many cooling leases");
+    return -1;
+    }
+  Lease *lease = &leases->leases[leases->n++];
+  lease->client = client;
+  lease->level = level;
+  lease->expires = expires;
+  mylog_info ("Cooling lease for level %d added (%d active)", level, 
+    leases->n);
+  return 0;
+  }
+
+/**
+  lease_release
+
+  Release the lease held by a control connection, when it hangs up.
+*/
+void lease_release (Leases *leases, int client)
+  {
+  for (int i = 0; i < leases->n; i++)
+    {
+    if (leases->leases[i].client == client)
+      {
+      drop_lease (leases, i);
+      mylog_info ("Cooling lease released (%d active)", leases->n);
+      return;
+      }
+    }
+  }
+
+/**
+  lease_level
+
+  Returns the highest level asked for by any lease that is still active at 
+time now, or -1 if there are none. Expired leases are removed.
+*/
+int lease_level (Leases *leases, uint64_t now)
+  {
+  int level = -1;
+  int i = 0;
+  while (i < leases->n)
+    {
+    Lease *lease = &leases->leases[i];
+    if (lease->expires != 0 && now >= lease->expires)
+      {
+      drop_lease (leases, i);
+      mylog_info ("Cooling lease expired (%d active)", leases->n);
+      continue;
+      }
+    if (lease->level > level) level = lease->level;
+    i++;
+    }
+  return level;
+  }
@@ -0,0 +1,34 @@
+/*=============================================================================
+
+  p53-fan
+  lease.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+// The most leases that can be active at once
+#define LEASE_MAX 16
+
+// A request from a client for the fan to run at some level or higher
+typedef struct _Lease
+  {
+  int client; // The control connection holding it, or -1 for a timed lease
+  int level;
+  uint64_t expires; // In stats_now() nanoseconds; 0 for never
+  } Lease;
+
+typedef struct _Leases
+  {
+  int n;
+  Lease leases[LEASE_MAX];
+  } Leases;
+
+extern int lease_add (Leases *leases, int client, int level, 
+         uint64_t expires);
+extern void lease_release (Leases *leases, int client);
+extern int lease_level (Leases *leases, uint64_t now);
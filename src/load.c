@@ -0,0 +1,168 @@
+/*=============================================================================
+
+  p53-fan
+  load.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Feed-forward from CPU load. The temperature lags the load by several 
+  seconds, so when the load steps up, we raise the fan straight away,
+  before the heat reaches the sensors. The extra levels then decay, one at
+  a time, leaving the fan curve in charge once the temperature has caught
+  up.
+
+  We look at CPU utilization from /proc/stat, and at CPU pressure (the
+  proportion of time that runnable tasks were waiting for a CPU) from
+  /proc/pressure/cpu. Both files stay open, and are read with pread().
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include "defs.h"
+#include "config.h"
+#include "mylog.h"
+#include "load.h"
+
+// A rise in utilization of at least this much since the last poll...
+#define LOAD_STEP_UTIL 0.3
+// ... to at least this much, counts as a load step
+#define LOAD_BUSY_UTIL 0.6
+// So does a rise in CPU pressure of at least this much
+#define LOAD_STEP_PRESSURE 0.25
+
+/**
+  read_stat
+
+  Read the aggregate 'cpu' line of /proc/stat, and return the busy and 
+total jiffies. Idle and iowait time count as not busy. Returns -1 if the
+line can't be read.
+*/
+static int read_stat (int fd, uint64_t *busy, uint64_t *total)
+  {
+  char buff[256];
+  int n = pread (fd, buff, sizeof (buff) - 1, 0);
+  if (n <= 0) return -1;
+  buff[n] = 0;
+  unsigned long long v[8] = { 0 };
+  if (sscanf (buff, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], 
+      &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) 
+    return -1;
+  *total = 0;
+  for (int i = 0; i < 8; i++) *total += v[i];
+  *busy = *total - v[3] - v[4];
+  return 0;
+  }
+
+/**
+  read_psi
+
+  Read the total stall time, in microseconds, from the 'some' line of 
+/proc/pressure/cpu. Returns -1 if it can't be read.
+*/
+static int read_psi (int fd, uint64_t *stall_us)
+  {
+  if (fd < 0) return -1;
+  char buff[256];
+  int n = pread (fd, buff, sizeof (buff) - 1, 0);
+  if (n <= 0) return -1;
+  buff[n] = 0;
+  const char *p = strstr (buff, "total=");
+  if (!p) return -1;
+  *stall_us = strtoull (p + 6, NULL, 10);
+  return 0;
+  }
+
+/**
+  load_init
+
+  Open the load statistics. levels is how many fan levels to add on a load
+step. Returns -1 (having logged the reason) if /proc/stat can't be opened;
+the absence of PSI, which not all kernels have, is not an error.
+*/
+int load_init (Load *load, int levels)
+  {
+  memset (load, 0, sizeof (Load));
+  load->levels = levels;
+  load->stat_fd = open (LOAD_STAT_FILE, O_RDONLY | O_CLOEXEC);
+  if (load->stat_fd < 0)
+    {
+    mylog_error ("Can't open '%s': %s", LOAD_STAT_FILE, strerror (errno));
+    return -1;
+    }
+  load->psi_fd = open (LOAD_PSI_FILE, O_RDONLY | O_CLOEXEC);
+  if (load->psi_fd < 0)
+    mylog_info ("No CPU pressure information: %s", strerror (errno));
+  return 0;
+  }
+
+/**
+  load_boost
+
+  Sample the load at time now (stats_now() nanoseconds), and return the 
+number of fan levels to add to whatever the temperature calls for. On a 
+load step, this is the configured number of levels; afterwards, it falls 
+by one every LOAD_DECAY_MS.
+*/
+int load_boost (Load *load, uint64_t now)
+  {
+  if (load->stat_fd < 0 || load->levels <= 0) return 0;
+  uint64_t busy, total, stall_us = 0;
+  if (read_stat (load->stat_fd, &busy, &total) != 0) return load->boost;
+  BOOL have_psi = (read_psi (load->psi_fd, &stall_us) == 0);
+
+  BOOL step = FALSE;
+  if (load->have_last && total > load->last_total && now > load->last_time)
+    {
+    double util = (double)(busy - load->last_busy) 
+      / (total - load->last_total);
+    double pressure = have_psi 
+      ? (stall_us - load->last_stall_us) / ((now - load->last_time) / 1e3)
+      : 0;
+    // A step is a rise since the last sample. Steady pressure, however 
+    //   high, isn't one, or the boost would never decay during a long 
+    //   build. The first sample just tells us where we are.
+    if (load->have_rates)
+      step = (util - load->util >= LOAD_STEP_UTIL && util >= LOAD_BUSY_UTIL)
+        || pressure - load->pressure >= LOAD_STEP_PRESSURE;
+    load->util = util;
+    load->pressure = pressure;
+    load->have_rates = TRUE;
+    }
+  load->last_busy = busy;
+  load->last_total = total;
+  load->last_stall_us = stall_us;
+  load->last_time = now;
+  load->have_last = TRUE;
+
+  if (step)
+    {
+    if (load->boost != load->levels)
+      mylog_info ("Load step (CPU %.0f%%, pressure %.0f%%): adding %d "
+        "fan levels", load->util * 100, load->pressure * 100, load->levels);
+    load->boost = load->levels;
+    load->boost_time = now;
+    }
+  else if (load->boost > 0 
+      && now - load->boost_time >= (uint64_t)LOAD_DECAY_MS * 1000000)
+    {
+    load->boost--;
+    load->boost_time = now;
+    mylog_debug ("Load boost now %d levels", load->boost);
+    }
+  return load->boost;
+  }
+
+/**
+  load_done
+*/
+void load_done (Load *load)
+  {
+  if (load->stat_fd >= 0) close (load->stat_fd);
+  if (load->psi_fd >= 0) close (load->psi_fd);
+  load->stat_fd = -1;
+  load->psi_fd = -1;
+  }
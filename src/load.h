@@ -0,0 +1,33 @@
+/*=============================================================================
+
+  p53-fan
+  load.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+typedef struct _Load
+  {
+  int levels; // How many levels to add on a load step; 0 for none
+  int boost; // How many levels we're adding now
+  double util; // CPU utilization, 0-1, over the last sample period
+  double pressure; // Fraction of time tasks were stalled waiting for a CPU
+  int stat_fd; // /proc/stat
+  int psi_fd; // /proc/pressure/cpu, or -1 if the kernel doesn't have PSI
+  uint64_t last_busy; // Jiffies
+  uint64_t last_total;
+  uint64_t last_stall_us;
+  uint64_t last_time; // stats_now() nanoseconds
+  uint64_t boost_time; // When the boost last changed
+  BOOL have_last;
+  BOOL have_rates; // TRUE once util and pressure have been measured
+  } Load;
+
+extern int load_init (Load *load, int levels);
+extern int load_boost (Load *load, uint64_t now);
+extern void load_done (Load *load);
@@ -14,22 +14,119 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
 #include "config.h"
 #include "defs.h"
 #include "hwmon_scan.h"
 #include "fan.h"
 #include "curve.h"
+#include "uevent.h"
+#include "evloop.h"
+#include "adaptive.h"
+#include "pid.h"
+#include "load.h"
+#include "power.h"
+#include "throttle.h"
+#include "lease.h"
+#include "alarm.h"
+#include "control.h"
+#include "actuator.h"
+#include "trace.h"
+#include "statuspage.h"
+#include "replay.h"
+#include "stats.h"
 #include "mylog.h"
 
-// dry_run is set by a command-line switch. It has to be global, because it's
-// used in the tidy-up signal handler.
+// dry_run is set by a command-line switch. It's global, because it's
+// used in all the event handlers.
 BOOL dry_run = FALSE;
 
-// We also have to make the lock FS global, for the same reason. The program
-// will hold a lock on this file so long as it is running.
+// The program will hold a lock on this file so long as it is running.
 int lock_fd = -1;
 
+// The state of the main loop, shared by the event handlers
+typedef struct _LoopContext
+  {
+  int level;
+  int curve_level; // The level the fan curve alone would choose
+  // The levels asked for by the inputs that work from rates, as of the
+  //   last regular poll
+  int last_pid, last_power, last_boost;
+  const Curve *curve;
+  BOOL predictive; // TRUE to use the PID controller as well as the curve
+  Pid pid;
+  int load_levels; // Levels to add on a step in CPU load; 0 for none
+  Load load;
+  Power power; // Package power, if a power map is given
+  const char *powercap_root;
+  Throttle throttle;
+  const char *cpu_root;
+  BOOL nothrottle; // TRUE not to raise the fan when the CPU is throttled
+  BOOL throttled; // TRUE while the CPU is being throttled
+  uint64_t hour_start; // For logging throttle events once an hour
+  uint64_t hour_core_events;
+  uint64_t hour_package_events;
+  Leases leases; // Requests from clients for extra cooling
+  BOOL use_alarms; // TRUE to poll at once when a sensor alarm goes off
+  Alarms alarms;
+  uint64_t last_alarm; // When an alarm last caused a poll
+  BOOL nowifi;
+  BOOL nodrivetemp;
+  int interval_ms;
+  int slow_interval_ms; // How often to read storage sensors
+  BOOL adaptive; // TRUE if the interval follows the temperature slope
+  Adaptive sched;
+  struct timespec deadline; // When the next poll is due
+  int timer_fd;
+  HSContext hs_context;
+  const char *hwmon_root;
+  SensorRules rules; // The user's sensor rules
+  const char *uevent_fifo; // For testing: NULL means use the kernel's events
+  const char *control_socket;
+  const char *status_page;
+  const char *manifest;
+  BOOL uring; // TRUE to read sensors using io_uring, if it's available
+  // Timings of the phases of each poll, when stats_enabled is set
+  Histogram scan_time;
+  Histogram curve_time;
+  Histogram fan_time;
+  Histogram tick_time;
+  BOOL stopping; // TRUE once the event loop has exited
+  } LoopContext;
+
+/**
+  timespec_add_ms
+*/
+static void timespec_add_ms (struct timespec *ts, int ms)
+  {
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000)
+    {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+    }
+  }
+
+/**
+  timespec_before
+  Returns TRUE if a is earlier than b.
+*/
+static BOOL timespec_before (const struct timespec *a, 
+         const struct timespec *b)
+  {
+  if (a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec;
+  return a->tv_nsec < b->tv_nsec;
+  }
+
 /** 
   get_lock
 
@@ -70,62 +167,858 @@ static void remove_lock (void)
   }
 
 /**
-  signal_quit
+  parse_interval
 
-  All the quit/stop/terminate signals end up here. We set the fan back to
-default, auto mode, and remove the lock.
+  Parse a time interval such as '5', '5s', '250ms', or '2m'. A number without
+units is in seconds. Returns the interval in milliseconds, or -1 if it can't
+be parsed. 
 */
-static void signal_quit (int dummy)
+static int parse_interval (const char *s)
   {
-  mylog_info ("Caught signal: cleaning up");
-  fan_to_auto (dry_run);
-  remove_lock();
-  exit (0);
+  char *end;
+  double v = strtod (s, &end);
+  if (end == s || v <= 0) return -1;
+  if (*end == 0 || strcmp (end, "s") == 0) v *= 1000;
+  else if (strcmp (end, "m") == 0) v *= 60000;
+  else if (strcmp (end, "ms") != 0) return -1;
+  if (v < 1 || v > 3600000) return -1;
+  return (int)v;
   }
 
 /**
-  main_loop 
+  parse_level
 
-  This is where all the work gets done: Just keep scanning the temperature and
-adjusting the fan, until the program receive a signal.
+  Parse a fan level for a lease: 'max', or a number from 0 to FAN_MAX. 
+Returns -1 if it can't be parsed.
 */
-static void main_loop (int interval, CurveNum curve_num, BOOL nowifi, BOOL nodrivetemp)
+static int parse_level (const char *s)
   {
-  int level = 3; // We have to start somewhere
-  HSContext hs_context;
-  while (1)
+  if (strcmp (s, "max") == 0) return FAN_MAX;
+  char *end;
+  long v = strtol (s, &end, 10);
+  if (end == s || *end != 0 || v < 0 || v > FAN_MAX) return -1;
+  return (int)v;
+  }
+
+/**
+  format_stats
+
+  Format the timing histograms for the phases of the poll, and for each 
+sensor, one per line.
+*/
+static void format_stats (const LoopContext *lc, char *buff, int len)
+  {
+  char line[256];
+  buff[0] = 0;
+  if (!stats_enabled)
+    {
+    snprintf (buff, len, "Statistics are not enabled");
+    return;
+    }
+  histogram_format (&lc->tick_time, "poll", line, sizeof (line));
+  snprintf (buff + strlen (buff), len - strlen (buff), "%s", line);
+  histogram_format (&lc->scan_time, "scan", line, sizeof (line));
+  snprintf (buff + strlen (buff), len - strlen (buff), "\n%s", line);
+  histogram_format (&lc->curve_time, "curve", line, sizeof (line));
+  snprintf (buff + strlen (buff), len - strlen (buff), "\n%s", line);
+  histogram_format (&lc->fan_time, "fan", line, sizeof (line));
+  snprintf (buff + strlen (buff), len - strlen (buff), "\n%s", line);
+  for (int i = 0; i < lc->hs_context.nsensors; i++)
+    {
+    const HSSensor *sensor = &lc->hs_context.sensors[i];
+    histogram_format (&sensor->read_time, sensor->path, line, sizeof (line));
+    snprintf (buff + strlen (buff), len - strlen (buff), "\n%s", line);
+    }
+  }
+
+/**
+  log_rpm
+
+  Log the fan speed statistics, one line per level.
+*/
+static void log_rpm (int level)
+  {
+  Rpm rpm;
+  actuator_get_rpm (&rpm);
+  char buff[4096];
+  rpm_format (&rpm, buff, sizeof (buff));
+  for (char *line = strtok (buff, "\n"); line; line = strtok (NULL, "\n"))
+    {
+    if (level == MYLOG_WARN) 
+      mylog_warn ("%s", line);
+    else
+      mylog_info ("%s", line);
+    }
+  }
+
+/**
+  do_signal
+
+  All the quit/stop/terminate signals end up here, by way of a signalfd. We
+just stop the event loop: main() sets the fan back to default, auto mode, and 
+removes the lock. SIGUSR1 also ends up here: it logs the timing statistics,
+and the fan speed statistics. These are logged as warnings, so they appear
+at the default log level.
+*/
+static void do_signal (int signal_fd, unsigned events, void *data)
+  {
+  LoopContext *lc = data;
+  struct signalfd_siginfo si;
+  if (read (signal_fd, &si, sizeof (si)) != sizeof (si)) return;
+  if (si.ssi_signo == SIGUSR1)
+    {
+    char buff[8192];
+    format_stats (lc, buff, sizeof (buff));
+    for (char *line = strtok (buff, "\n"); line; line = strtok (NULL, "\n"))
+      mylog_warn ("%s", line);
+    log_rpm (MYLOG_WARN);
+    return;
+    }
+  mylog_info ("Caught signal %d: cleaning up", si.ssi_signo);
+  evloop_quit ();
+  }
+
+/**
+  arm_timer
+
+  Set the timer to expire one interval after the previous deadline. Because
+the deadline is absolute, the time taken to scan and set the fan doesn't make
+the loop drift. If we've fallen more than a whole interval behind (perhaps the
+system was suspended) we don't try to catch up; we just start again from now.
+*/
+static void arm_timer (LoopContext *lc)
+  {
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  timespec_add_ms (&lc->deadline, lc->interval_ms);
+  if (timespec_before (&lc->deadline, &now))
+    {
+    lc->deadline = now;
+    timespec_add_ms (&lc->deadline, lc->interval_ms);
+    }
+  struct itimerspec its;
+  memset (&its, 0, sizeof (its));
+  its.it_value = lc->deadline;
+  timerfd_settime (lc->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+  }
+
+/**
+  tick
+
+  This is where all the work gets done: scan the temperature and adjust the
+fan. regular is FALSE for a poll out of turn -- for an alarm, or a command 
+that has to take effect at once. Such a poll can come a few milliseconds 
+after the last one, and a change of a degree over that time would look 
+like a huge rate of rise. So the inputs that work from rates (the PID 
+controller, package power and load) aren't sampled, and their last levels
+are used; only the curve, throttling and leases are brought up to date.
+*/
+static int tick (LoopContext *lc, BOOL regular)
+  {
+  HSContext *hs_context = &lc->hs_context;
+  uint64_t t0 = stats_enabled ? stats_now () : 0;
+  int ret = hwmon_scan (hs_context, lc->nowifi, lc->nodrivetemp);
+  uint64_t t1 = stats_enabled ? stats_now () : 0;
+  if (stats_enabled) histogram_add (&lc->scan_time, t1 - t0);
+  if (ret == 0)
+    {
+    mylog_info ("Max temp %dC, driver '%s' path='%s' label='%s'", 
+       hs_context->max_temp, hs_context->driver, hs_context->path, 
+       hs_context->label);
+    // The curve timing covers only the level decision, not the logging
+    t1 = stats_enabled ? stats_now () : 0;
+    // The curve keeps its own idea of the level, so the PID controller
+    //   doesn't upset its hysteresis
+    lc->curve_level = curve_get_level (lc->curve, lc->curve_level, 
+       hs_context->max_temp);
+    int new_level = lc->curve_level;
+    if (lc->predictive)
+      {
+      if (regular)
+        lc->last_pid = pid_next (&lc->pid, lc->curve, stats_now () / 1e9, 
+          hs_context->max_temp);
+      if (lc->last_pid > new_level) new_level = lc->last_pid;
+      }
+    // Throttling costs throughput, so while the CPU is being throttled, 
+    //   the fan runs at least a level above what the curve says
+    uint64_t now = stats_now ();
+    BOOL throttled = throttle_poll (&lc->throttle, now);
+    if (throttled && !lc->nothrottle)
+      {
+      int above = lc->curve_level < FAN_MAX ? lc->curve_level + 1 : FAN_MAX;
+      if (above > new_level) new_level = above;
+      }
+
+    // Package power rises as soon as the load does
+    if (regular) lc->last_power = power_level (&lc->power, now);
+    if (lc->last_power > new_level) new_level = lc->last_power;
+    // A step in CPU load raises the fan before the heat reaches the 
+    //   sensors -- but load alone never puts the fan into disengaged mode
+    if (regular) lc->last_boost = load_boost (&lc->load, now);
+    int boost = lc->last_boost;
+    if (boost > 0 && new_level < FAN_MAX - 1)
+      {
+      new_level += boost;
+      if (new_level > FAN_MAX - 1) new_level = FAN_MAX - 1;
+      }
+    // A client that has asked for more cooling gets it, whatever the 
+    //   temperature
+    int leased = lease_level (&lc->leases, now);
+    if (leased > new_level) new_level = leased;
+    uint64_t t2 = stats_enabled ? stats_now () : 0;
+
+    if (throttled != lc->throttled)
+      {
+      if (throttled)
+        mylog_warn ("CPU is being throttled (%.1f events/hour with curve "
+          "'%s')", throttle_rate (&lc->throttle, now), 
+          curve_get_name (lc->curve));
+      else
+        mylog_info ("CPU is no longer being throttled");
+      lc->throttled = throttled;
+      }
+    if (now - lc->hour_start >= 3600000000000ULL)
+      {
+      uint64_t core = lc->throttle.core_events - lc->hour_core_events;
+      uint64_t package = lc->throttle.package_events 
+        - lc->hour_package_events;
+      if (core > 0 || package > 0)
+        mylog_info ("%llu core and %llu package throttle events in the last "
+          "hour, with curve '%s'", (unsigned long long)core, 
+          (unsigned long long)package, curve_get_name (lc->curve));
+      lc->hour_start = now;
+      lc->hour_core_events = lc->throttle.core_events;
+      lc->hour_package_events = lc->throttle.package_events;
+      }
+
+    // The level is posted even if we haven't changed it, because 
+    //   fan_set_level() checks the actual level, in case something else is
+    //   fiddling with it. The write happens on the actuator thread, and 
+    //   its time is counted there.
+    mylog_info ("Setting fan level %d", new_level);
+    actuator_post (new_level);
+    lc->level = new_level;
+    trace_append (new_level, hs_context);
+    statuspage_update (new_level, curve_get_name (lc->curve), hs_context);
+    if (lc->use_alarms)
+      {
+      // The alarms go off at the temperature where the curve would raise
+      //   the fan
+      int min, max;
+      curve_get_range (lc->curve, lc->curve_level, &min, &max);
+      alarm_arm (&lc->alarms, hs_context, max);
+      }
+    if (stats_enabled)
+      {
+      uint64_t t3 = stats_now ();
+      histogram_add (&lc->curve_time, t2 - t1);
+      histogram_add (&lc->tick_time, t3 - t0);
+      }
+    }
+  return ret;
+  }
+
+/**
+  adapt_interval
+
+  If adaptive polling is enabled, choose the interval until the next poll
+from the temperature just read, and how close it is to a change of fan level.
+*/
+static void adapt_interval (LoopContext *lc)
+  {
+  if (!lc->adaptive) return;
+  int min, max;
+  // The curve's own level, not the one PID, boost or power have moved 
+  //   the fan to; only the curve's band says how near a change we are
+  curve_get_range (lc->curve, lc->curve_level, &min, &max);
+  double now = lc->deadline.tv_sec + lc->deadline.tv_nsec / 1e9;
+  lc->interval_ms = adaptive_next (&lc->sched, now, 
+    lc->hs_context.max_temp, min, max);
+  }
+
+/**
+  do_timer
+
+  Called when the poll interval has elapsed. 
+*/
+static void do_timer (int timer_fd, unsigned events, void *data)
+  {
+  LoopContext *lc = data;
+  uint64_t expirations;
+  if (read (timer_fd, &expirations, sizeof (expirations)) <= 0) return;
+  if (tick (lc, TRUE) == 0) adapt_interval (lc);
+  arm_timer (lc);
+  }
+
+/**
+  reschedule
+
+  Start timing the poll interval again from now, after it has been changed.
+*/
+static void reschedule (LoopContext *lc)
+  {
+  clock_gettime (CLOCK_MONOTONIC, &lc->deadline);
+  arm_timer (lc);
+  }
+
+/**
+  poll_now
+
+  Poll straight away, out of turn, because the temperature has passed an 
+alarm threshold, or a thermal zone has changed. If we polled for this 
+reason very recently, poll again when ALARM_MIN_GAP_MS is up, rather than
+at the end of the interval.
+*/
+static void poll_now (LoopContext *lc, const char *why)
+  {
+  uint64_t now = stats_now ();
+  if (now - lc->last_alarm < ALARM_MIN_GAP_MS * 1000000ULL)
+    {
+    struct timespec when;
+    clock_gettime (CLOCK_MONOTONIC, &when);
+    timespec_add_ms (&when, ALARM_MIN_GAP_MS);
+    if (timespec_before (&when, &lc->deadline))
+      {
+      lc->deadline = when;
+      struct itimerspec its;
+      memset (&its, 0, sizeof (its));
+      its.it_value = lc->deadline;
+      timerfd_settime (lc->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+      }
+    return;
+    }
+  lc->last_alarm = now;
+  mylog_info ("Polling now: %s", why);
+  tick (lc, FALSE);
+  reschedule (lc);
+  }
+
+/**
+  do_alarm
+
+  Called when a sensor's alarm file is notified. 
+*/
+static void do_alarm (int fd, unsigned events, void *data)
+  {
+  LoopContext *lc = data;
+  // The alarm going off is what matters; it going back is just the 
+  //   result of raising the fan
+  if (alarm_ack (fd)) poll_now (lc, "temperature alarm");
+  }
+
+/**
+  do_uevents
+
+  Apply hwmon hotplug events to the sensor table, as they arrive. 
+*/
+static void do_uevents (int uevent_fd, unsigned events, void *data)
+  {
+  LoopContext *lc = data;
+  UEvent event;
+  while (uevent_read (uevent_fd, &event) > 0)
+    {
+    // A thermal zone reports a change when it passes a trip point
+    if (lc->use_alarms && strcmp (event.subsystem, "thermal") == 0 
+        && event.action == UEVENT_CHANGE)
+      poll_now (lc, "thermal zone event");
+    if (strcmp (event.subsystem, "hwmon") != 0) continue;
+    const char *name = uevent_devname (&event);
+    mylog_debug ("uevent %d for hwmon device '%s'", event.action, name);
+    if (event.action == UEVENT_REMOVE)
+      hwmon_device_removed (&lc->hs_context, name);
+    else
+      hwmon_device_added (&lc->hs_context, name);
+    }
+  }
+
+/**
+  parse_on_off
+  Returns 1 for 'on', 0 for 'off', and -1 for anything else.
+*/
+static int parse_on_off (const char *s)
+  {
+  if (strcmp (s, "on") == 0) return 1;
+  if (strcmp (s, "off") == 0) return 0;
+  return -1;
+  }
+
+/**
+  do_command
+
+  Handle a command from the control socket. Because commands are handled by
+the event loop, between polls, each takes effect all at once, and the sensor
+table and current fan level are unaffected. The commands are:
+
+  status
+  curve NAME
+  interval T
+  slow-interval T
+  adaptive MIN MAX | adaptive off
+  controller curve|pid
+  load-boost N
+  power-map W1,W2,...|off
+  throttle-boost on|off
+  alarms on|off
+  target T
+  lease max|LEVEL [T]
+  stats
+  stats on|off
+  rpm
+  log-level N
+  wifi on|off
+  drivetemp on|off
+
+  The reply starts with 'OK' or 'ERROR'. A lease without a time lasts until
+the client hangs up, so for that command we return TRUE, to keep the 
+connection open.
+*/
+static BOOL do_command (int client, const char *command, char *reply, 
+         int reply_len, void *data)
+  {
+  LoopContext *lc = data;
+  char verb[32], arg1[64], arg2[64];
+  int n = sscanf (command, "%31s %63s %63s", verb, arg1, arg2);
+  if (n < 1)
+    {
+    snprintf (reply, reply_len, "ERROR no command");
+    return FALSE;
+    }
+
+  if (strcmp (verb, "status") == 0)
+    {
+    FanStats fan_stats;
+    fan_get_stats (&fan_stats);
+    Rpm rpm;
+    actuator_get_rpm (&rpm);
+    char speeds[64];
+    rpm_format_speeds (&rpm, speeds, sizeof (speeds));
+    snprintf (reply, reply_len, "OK curve=%s level=%d temp=%d "
+      "controller=%s target=%d load-boost=%d/%d power=%.1fW "
+      "core-throttles=%llu package-throttles=%llu throttle-rate=%.1f/h "
+      "throttle-boost=%s leases=%d alarms=%d interval=%dms "
+      "slow-interval=%dms adaptive=%s sensors=%d wifi=%s drivetemp=%s "
+      "log-level=%d fan-writes=%u fan-tampers=%u rpm=%s fan-faults=%u", 
+      curve_get_name (lc->curve), lc->level, lc->hs_context.max_temp, 
+      lc->predictive ? "pid" : "curve", lc->pid.target, lc->load.boost, 
+      lc->load.levels, lc->power.watts, 
+      (unsigned long long)lc->throttle.core_events, 
+      (unsigned long long)lc->throttle.package_events, 
+      throttle_rate (&lc->throttle, stats_now ()), 
+      lc->nothrottle ? "off" : "on", 
+      lc->leases.n, lc->use_alarms ? lc->alarms.n : -1, lc->interval_ms, 
+      lc->slow_interval_ms, lc->adaptive ? "on" : "off", 
+      lc->hs_context.nsensors, lc->nowifi ? "off" : "on", 
+      lc->nodrivetemp ? "off" : "on", mylog_level, 
+      fan_stats.writes, fan_stats.tampers, speeds, rpm.faults);
+    }
+  else if (strcmp (verb, "curve") == 0 && n == 2)
+    {
+    const Curve *curve = curve_find (arg1);
+    if (!curve)
+      {
+      snprintf (reply, reply_len, "ERROR unknown curve '%s'", arg1);
+      return FALSE;
+      }
+    lc->curve = curve;
+    // The throttle rate we report is for the curve in use
+    throttle_reset_rate (&lc->throttle, stats_now ());
+    mylog_info ("Fan curve changed to '%s'", arg1);
+    // Apply the new curve straight away, rather than at the next poll
+    tick (lc, FALSE);
+    reschedule (lc);
+    snprintf (reply, reply_len, "OK level=%d", lc->level);
+    }
+  else if (strcmp (verb, "interval") == 0 && n == 2)
     {
-    if (hwmon_scan (&hs_context, nowifi, nodrivetemp) == 0)
+    int ms = parse_interval (arg1);
+    if (ms < 0)
       {
-      mylog_info ("Max temp %dC, driver '%s' path='%s' label='%s'", hs_context.max_temp,
-         hs_context.driver, hs_context.path, hs_context.label);
-      int new_level = curve_get_level (curve_num, level, hs_context.max_temp);
-      // We need to set the level even if it hasn't changed, because something else
-      //   might be fiddling with it
-      mylog_info ("Setting fan level %d", new_level);
-      fan_set_level (new_level, dry_run);
-      level = new_level;
+      snprintf (reply, reply_len, "ERROR invalid interval '%s'", arg1);
+      return FALSE;
       }
-    sleep(interval);
+    lc->interval_ms = ms;
+    lc->adaptive = FALSE;
+    reschedule (lc);
+    snprintf (reply, reply_len, "OK");
     }
+  else if (strcmp (verb, "slow-interval") == 0 && n == 2)
+    {
+    int ms = parse_interval (arg1);
+    if (ms < 0)
+      {
+      snprintf (reply, reply_len, "ERROR invalid interval '%s'", arg1);
+      return FALSE;
+      }
+    lc->slow_interval_ms = ms;
+    lc->hs_context.slow_period_ms = ms;
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "adaptive") == 0 && n == 2 
+      && strcmp (arg1, "off") == 0)
+    {
+    lc->adaptive = FALSE;
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "adaptive") == 0 && n == 3)
+    {
+    int min_ms = parse_interval (arg1);
+    int max_ms = parse_interval (arg2);
+    if (min_ms < 0 || max_ms < min_ms)
+      {
+      snprintf (reply, reply_len, "ERROR invalid intervals");
+      return FALSE;
+      }
+    adaptive_init (&lc->sched, min_ms, max_ms, lc->interval_ms);
+    lc->interval_ms = lc->sched.interval_ms;
+    lc->adaptive = TRUE;
+    reschedule (lc);
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "controller") == 0 && n == 2 
+      && (strcmp (arg1, "curve") == 0 || strcmp (arg1, "pid") == 0))
+    {
+    BOOL predictive = (strcmp (arg1, "pid") == 0);
+    if (predictive && !lc->predictive) 
+      {
+      pid_init (&lc->pid, lc->pid.target);
+      lc->last_pid = 0;
+      }
+    lc->predictive = predictive;
+    mylog_info ("Controller changed to '%s'", arg1);
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "load-boost") == 0 && n == 2)
+    {
+    int levels = atoi (arg1);
+    if (levels < 0 || levels > FAN_MAX)
+      {
+      snprintf (reply, reply_len, "ERROR invalid number of levels '%s'", arg1);
+      return FALSE;
+      }
+    lc->load.levels = levels;
+    if (lc->load.boost > levels) lc->load.boost = levels;
+    // The boost the last poll asked for was sized for the old setting; 
+    //   the next regular poll works out a new one
+    lc->last_boost = 0;
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "throttle-boost") == 0 && n == 2 
+      && parse_on_off (arg1) >= 0)
+    {
+    lc->nothrottle = !parse_on_off (arg1);
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "alarms") == 0 && n == 2 
+      && parse_on_off (arg1) >= 0)
+    {
+    lc->use_alarms = parse_on_off (arg1);
+    // The alarms are set up again at the next poll, if they're wanted
+    alarm_done (&lc->alarms);
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "power-map") == 0 && n == 2)
+    {
+    Power *power = &lc->power;
+    if (strcmp (arg1, "off") != 0 && power->ndomains == 0
+        && power_init (power, lc->powercap_root) != 0)
+      {
+      snprintf (reply, reply_len, "ERROR no package power information");
+      return FALSE;
+      }
+    if (power_parse_map (power, arg1) != 0)
+      {
+      snprintf (reply, reply_len, "ERROR invalid power map '%s'", arg1);
+      return FALSE;
+      }
+    // The level the last poll took from the old map no longer applies
+    lc->last_power = 0;
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "target") == 0 && n == 2)
+    {
+    int target = atoi (arg1);
+    if (target <= CURVE_TEMP_MIN || target > CURVE_TEMP_MAX)
+      {
+      snprintf (reply, reply_len, "ERROR invalid target '%s'", arg1);
+      return FALSE;
+      }
+    lc->pid.target = target;
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "lease") == 0 && (n == 2 || n == 3))
+    {
+    int level = parse_level (arg1);
+    int ms = n == 3 ? parse_interval (arg2) : 0;
+    if (level < 0 || ms < 0)
+      {
+      snprintf (reply, reply_len, "ERROR invalid lease '%s'", command);
+      return FALSE;
+      }
+    uint64_t expires = n == 3 ? stats_now () + ms * 1000000ULL : 0;
+    if (lease_add (&lc->leases, n == 3 ? -1 : client, level, expires) != 0)
+      {
+      snprintf (reply, reply_len, "ERROR too many leases");
+      return FALSE;
+      }
+    // Apply the lease straight away, rather than at the next poll
+    tick (lc, FALSE);
+    reschedule (lc);
+    snprintf (reply, reply_len, "OK level=%d", lc->level);
+    return n == 2;
+    }
+  else if (strcmp (verb, "rpm") == 0 && n == 1)
+    {
+    Rpm rpm;
+    actuator_get_rpm (&rpm);
+    strcpy (reply, "OK\n");
+    rpm_format (&rpm, reply + 3, reply_len - 3);
+    }
+  else if (strcmp (verb, "stats") == 0 && n == 1)
+    {
+    strcpy (reply, "OK\n");
+    format_stats (lc, reply + 3, reply_len - 3);
+    }
+  else if (strcmp (verb, "stats") == 0 && n == 2 && parse_on_off (arg1) >= 0)
+    {
+    stats_enabled = parse_on_off (arg1);
+    snprintf (reply, reply_len, "OK");
+    }
+  else if (strcmp (verb, "log-level") == 0 && n == 2)
+    {
+    mylog_level = atoi (arg1);
+    snprintf (reply, reply_len, "OK");
+    }
+  else if ((strcmp (verb, "wifi") == 0 || strcmp (verb, "drivetemp") == 0) 
+      && n == 2 && parse_on_off (arg1) >= 0)
+    {
+    // The sensor table will be rebuilt at the next poll
+    BOOL exclude = !parse_on_off (arg1);
+    if (strcmp (verb, "wifi") == 0)
+      lc->nowifi = exclude;
+    else
+      lc->nodrivetemp = exclude;
+    snprintf (reply, reply_len, "OK");
+    }
+  else
+    snprintf (reply, reply_len, "ERROR can't understand '%s'", command);
+  return FALSE;
+  }
+
+/**
+  do_hangup
+
+  Called when a client that holds a lease closes its connection. 
+*/
+static void do_hangup (int client, void *data)
+  {
+  LoopContext *lc = data;
+  lease_release (&lc->leases, client);
+  // Closing the socket on the way out hangs up on every client; there's 
+  //   no fan level to change by then
+  if (lc->stopping) return;
+  // Let the fan drop back straight away, rather than at the next poll
+  tick (lc, FALSE);
+  reschedule (lc);
+  }
+
+/**
+  run_file
+
+  Work out the path of one of the files that we normally keep in RUN_DIR.
+If the hwmon root has been overridden, for testing, the file goes in the 
+directory that contains the fake tree instead. Returns path, or buff.
+*/
+static const char *run_file (const char *hwmon_root, const char *path, 
+         const char *name, char *buff, int len)
+  {
+  if (strcmp (hwmon_root, HWMON_ROOT) == 0) return path;
+  int n = strlen (hwmon_root);
+  while (n > 1 && hwmon_root[n - 1] == '/') n--;
+  while (n > 0 && hwmon_root[n - 1] != '/') n--;
+  if (n == 0)
+    snprintf (buff, len, "%s", name);
+  else
+    snprintf (buff, len, "%.*s%s", n, hwmon_root, name);
+  return buff;
+  }
+
+/**
+  run_with_lease
+
+  Take out a cooling lease from a running instance, then run a command, and 
+hold the lease until it finishes. The lease is released when the connection
+closes, so it goes even if we're killed. Returns the command's exit status. 
+*/
+static int run_with_lease (const char *socket, const char *level, 
+         char **argv)
+  {
+  char command[64];
+  char reply[256];
+  snprintf (command, sizeof (command), "lease %s", level);
+  int fd = control_hold (socket, command, reply, sizeof (reply));
+  if (fd < 0) return 1;
+  if (strncmp (reply, "OK", 2) != 0)
+    {
+    mylog_error ("Can't get cooling lease: %s", reply);
+    close (fd);
+    return 1;
+    }
+  mylog_info ("Got cooling lease: %s", reply);
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+    execvp (argv[0], argv);
+    mylog_error ("Can't run '%s': %s", argv[0], strerror (errno));
+    _exit (127);
+    }
+  int status = 1;
+  if (pid < 0)
+    mylog_error ("Can't fork: %s", strerror (errno));
+  else
+    {
+    // An interrupt from the terminal goes to the command as well, which
+    //   decides whether to stop. We wait for it either way.
+    signal (SIGINT, SIG_IGN);
+    signal (SIGQUIT, SIG_IGN);
+    while (waitpid (pid, &status, 0) < 0 && errno == EINTR);
+    if (WIFEXITED (status)) 
+      status = WEXITSTATUS (status);
+    else
+      status = 128 + WTERMSIG (status);
+    }
+  close (fd);
+  return status;
+  }
+
+/**
+  main_loop 
+
+  Set up the timer, signal, hotplug and control descriptors, then hand over to
+the event loop, until the program receives a signal. Returns 0 if it was a
+signal that stopped the loop.
+*/
+static int main_loop (LoopContext *lc)
+  {
+  hwmon_init (&lc->hs_context, lc->hwmon_root);
+  lc->hs_context.user_rules = &lc->rules;
+  lc->hs_context.slow_period_ms = lc->slow_interval_ms;
+  lc->hs_context.manifest = lc->manifest;
+  // Without io_uring, we just read the sensors one at a time
+  if (lc->uring && hwmon_use_uring (&lc->hs_context) == 0)
+    mylog_info ("Reading sensors using io_uring");
+  // Without /proc/stat, there's just no load boost
+  load_init (&lc->load, lc->load_levels);
+  // Without throttle counters, we just can't tell when the CPU throttles
+  throttle_init (&lc->throttle, lc->cpu_root);
+  throttle_reset_rate (&lc->throttle, stats_now ());
+  lc->hour_start = stats_now ();
+  // Without RAPL, the power map is ignored
+  if (lc->power.nthresholds > 0) 
+    power_init (&lc->power, lc->powercap_root);
+
+  if (evloop_init () != 0) return -1;
+
+  sigset_t mask;
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGQUIT);
+  sigaddset (&mask, SIGTERM);
+  sigaddset (&mask, SIGUSR1);
+  int signal_fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  lc->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (signal_fd < 0 || lc->timer_fd < 0)
+    {
+    mylog_error ("Can't create timer or signal descriptor: %s", 
+      strerror (errno));
+    return -1;
+    }
+  evloop_add (signal_fd, EPOLLIN, do_signal, lc);
+  evloop_add (lc->timer_fd, EPOLLIN, do_timer, lc);
+
+  int uevent_fd = uevent_open (lc->uevent_fifo);
+  // If we can't get hotplug events, the scanner will just rediscover the
+  //   sensors from time to time
+  lc->hs_context.hotplug = (uevent_fd >= 0);
+  if (uevent_fd >= 0) evloop_add (uevent_fd, EPOLLIN, do_uevents, lc);
+
+  // We can run without the control socket; it just means that we can't be
+  //   reconfigured
+  control_init (lc->control_socket, do_command, do_hangup, lc);
+  // Without alarms, we just find out about temperatures at the next poll
+  alarm_init (&lc->alarms, do_alarm, lc);
+  // Nor do we need the status page; it's just for other programs
+  statuspage_open (lc->status_page);
+
+  // Without the thinkpad hwmon device, we can only check the first fan's 
+  //   speed, from the fan control file
+  if (!dry_run) fan_open_speeds (lc->hwmon_root);
+  // Without the actuator thread, the fan is set from the main loop, as 
+  //   it used to be
+  actuator_start (dry_run, &lc->fan_time);
+
+  // The first poll happens straight away
+  clock_gettime (CLOCK_MONOTONIC, &lc->deadline);
+  if (tick (lc, TRUE) == 0) adapt_interval (lc);
+  arm_timer (lc);
+
+  int ret = evloop_run ();
+  lc->stopping = TRUE;
+
+  // The control socket goes first, because a client's hangup can change
+  //   the fan level. Once the actuator has stopped, nothing else will, 
+  //   so the caller can safely return it to automatic control
+  control_done ();
+  actuator_stop ();
+  log_rpm (MYLOG_INFO);
+  alarm_done (&lc->alarms);
+  statuspage_close ();
+  evloop_done ();
+  uevent_close (uevent_fd);
+  close (lc->timer_fd);
+  close (signal_fd);
+  hwmon_done (&lc->hs_context);
+  load_done (&lc->load);
+  power_done (&lc->power);
+  throttle_done (&lc->throttle);
+  return ret;
+  }
+
+/**
+  interval_from_arg
+
+  Parse an interval from the command line, and just exit if it's invalid.
+*/
+static int interval_from_arg (const char *arg)
+  {
+  int ms = parse_interval (arg); 
+  if (ms < 0)
+    {
+    mylog_error ("Invalid interval: %s. Use, e.g., '5', '5s', or '250ms'", arg);
+    exit (0);
+    }
+  return ms;
   }
 
 /**
   curve_from_name
 
-  Get the curve number that corresponds to the given name. This function is
-only used for parsing the command line, and we just exit if it fails. 
+  Get the curve that corresponds to the given name, which may be one of the
+built-in curves or one from the curve file. This function is only used for
+processing the command line, and we just exit if it fails. 
 */
-static CurveNum curve_from_name (const char *name)
+static const Curve *curve_from_name (const char *name)
   {
-  if (strcmp (name, "cold") == 0) return CURVE_COLD;
-  if (strcmp (name, "cool") == 0) return CURVE_COOL;
-  if (strcmp (name, "medium") == 0) return CURVE_MEDIUM;
-  if (strcmp (name, "warm") == 0) return CURVE_WARM;
-  if (strcmp (name, "hot") == 0) return CURVE_HOT;
-
-  mylog_error ("Unknown curve: %s. "
-    "Valid values are 'hot', 'warm', 'medium', 'cool', and 'cold'", name);
+  const Curve *curve = curve_find (name);
+  if (curve) return curve;
+
+  char names[256] = "";
+  for (int i = 0; i < curve_get_count (); i++)
+    {
+    if (i > 0) strncat (names, ", ", sizeof (names) - strlen (names) - 1);
+    strncat (names, curve_get_name (curve_get (i)), 
+      sizeof (names) - strlen (names) - 1);
+    }
+  mylog_error ("Unknown curve: %s. Valid values are: %s", name, names);
   exit (0);
   }
 
@@ -170,24 +1063,71 @@ int main (int argc, char **argv)
   BOOL show_help = FALSE;
   BOOL foreground = FALSE;
   BOOL stop = FALSE;
-  BOOL nowifi = FALSE;
-  BOOL nodrivetemp = FALSE;
-  int interval = -1;
+  BOOL ctl = FALSE;
+  int min_interval_ms = -1;
+  int max_interval_ms = -1;
   int log_level = MYLOG_WARN;
-  CurveNum curve_num = CURVE_MEDIUM;;
+  const char *curve_name = "medium";
+  const char *curve_file = NULL;
+  const char *rules_file = NULL;
+  const char *record_file = NULL;
+  const char *controller = "curve";
+  const char *power_map = NULL;
+  const char *replay_file = NULL;
+  const char *with_lease = NULL;
+
+  // Most of the settings end up in the main loop's context
+  LoopContext lc;
+  memset (&lc, 0, sizeof (lc));
+  lc.level = 3; // We have to start somewhere
+  lc.curve_level = lc.level;
+  pid_init (&lc.pid, DEFAULT_PID_TARGET);
+  lc.interval_ms = 5000;
+  lc.hwmon_root = HWMON_ROOT;
+  lc.powercap_root = POWERCAP_ROOT;
+  lc.cpu_root = CPU_ROOT;
+  lc.slow_interval_ms = DEFAULT_SLOW_INTERVAL_MS;
+  lc.control_socket = CONTROL_SOCKET;
+  char manifest[PATH_MAX], status_page[PATH_MAX];
 
   static struct option long_options[] =
     {
+     {"alarms", no_argument, NULL, 'H'},
+     {"cpu-root", required_argument, NULL, 'Y'},
      {"curve", required_argument, NULL, 'c'},
+     {"curve-file", required_argument, NULL, 'C'},
+     {"controller", required_argument, NULL, 'K'},
+     {"ctl", no_argument, NULL, 'X'},
      {"dry-run", no_argument, NULL, 'd'},
+     {"fan-file", required_argument, NULL, 'F'},
      {"foreground", no_argument, NULL, 'f'},
      {"help", no_argument, NULL, 'h'},
+     {"hwmon-root", required_argument, NULL, 'R'},
      {"interval", required_argument, NULL, 'i'},
+     {"load-boost", required_argument, NULL, 'B'},
      {"log-level", required_argument, NULL, 'l'},
+     {"manifest", required_argument, NULL, 'J'},
+     {"max-interval", required_argument, NULL, 'M'},
+     {"min-interval", required_argument, NULL, 'm'},
+     {"power-map", required_argument, NULL, 'W'},
+     {"powercap-root", required_argument, NULL, 'Q'},
+     {"record", required_argument, NULL, 'E'},
+     {"replay", required_argument, NULL, 'P'},
+     {"rule", required_argument, NULL, 'Z'},
+     {"rules-file", required_argument, NULL, 'O'},
      {"no-drivetemp", no_argument, NULL, 'n'},
+     {"no-throttle-boost", no_argument, NULL, 'N'},
+     {"slow-interval", required_argument, NULL, 'D'},
+     {"socket", required_argument, NULL, 'S'},
+     {"stats", no_argument, NULL, 'T'},
+     {"status-page", required_argument, NULL, 'A'},
      {"stop", no_argument, NULL, 's'},
+     {"target", required_argument, NULL, 'G'},
+     {"uring", no_argument, NULL, 'u'},
      {"version", no_argument, NULL, 'v'},
      {"no-wifi", no_argument, NULL, 'w'},
+     {"with-lease", required_argument, NULL, 'L'},
+     {"uevents", required_argument, NULL, 'U'},
      {0, 0, 0, 0}
     };
 
@@ -202,16 +1142,48 @@ int main (int argc, char **argv)
 
     switch (opt)
       {
-      case 'c': curve_num = curve_from_name (optarg); break;
+      case 'A': lc.status_page = optarg; break;
+      case 'c': curve_name = optarg; break;
+      case 'B': lc.load_levels = atoi (optarg); break;
+      case 'C': curve_file = optarg; break;
       case 'd': dry_run = TRUE; break;
+      case 'E': record_file = optarg; break;
+      case 'D': lc.slow_interval_ms = interval_from_arg (optarg); break;
       case 'f': foreground = TRUE; break;
+      case 'G': lc.pid.target = atoi (optarg); break;
+      case 'H': lc.use_alarms = TRUE; break;
+      case 'F': fan_set_file (optarg); break;
       case 'h': show_help = TRUE; break;
-      case 'i': interval = atoi (optarg); break;
+      case 'i': lc.interval_ms = interval_from_arg (optarg); break;
+      case 'm': min_interval_ms = interval_from_arg (optarg); break;
+      case 'M': max_interval_ms = interval_from_arg (optarg); break;
+      case 'K': controller = optarg; break;
       case 'l': log_level = atoi (optarg); break;
-      case 'n': nodrivetemp = TRUE; break;
+      case 'J': lc.manifest = optarg; break;
+      case 'L': with_lease = optarg; break;
+      case 'n': lc.nodrivetemp = TRUE; break;
+      case 'N': lc.nothrottle = TRUE; break;
+      case 'O': rules_file = optarg; break;
+      case 'P': replay_file = optarg; break;
+      case 'Q': lc.powercap_root = optarg; break;
+      case 'R': lc.hwmon_root = optarg; break;
       case 's': stop = TRUE; break;
+      case 'S': lc.control_socket = optarg; break;
+      case 'T': stats_enabled = TRUE; break;
       case 'v': show_version = TRUE; break;
-      case 'w': nowifi = TRUE; break;
+      case 'u': lc.uring = TRUE; break;
+      case 'U': lc.uevent_fifo = optarg; break;
+      case 'w': lc.nowifi = TRUE; break;
+      case 'W': power_map = optarg; break;
+      case 'X': ctl = TRUE; break;
+      case 'Y': lc.cpu_root = optarg; break;
+      case 'Z': 
+        if (rules_parse (&lc.rules, optarg) != 0)
+          {
+          mylog_error ("Invalid sensor rule '%s'", optarg);
+          exit (0);
+          }
+        break;
       }
     }
 
@@ -221,6 +1193,36 @@ int main (int argc, char **argv)
     exit (0);
     }
 
+  if (ctl)
+    {
+    // The command is everything on the command line after the options
+    char command[256] = "";
+    for (int i = optind; i < argc; i++)
+      {
+      int left = sizeof (command) - strlen (command) - 1;
+      if (i > optind) strncat (command, " ", left--);
+      strncat (command, argv[i], left);
+      }
+    char reply[8192];
+    if (control_send (lc.control_socket, command, reply, sizeof (reply)) != 0)
+      exit (1);
+    printf ("%s\n", reply);
+    exit (strncmp (reply, "OK", 2) == 0 ? 0 : 1);
+    }
+
+  if (with_lease)
+    {
+    // The command is everything on the command line after the options,
+    //   usually after '--'
+    if (optind >= argc)
+      {
+      mylog_error ("No command to run with the lease");
+      exit (1);
+      }
+    mylog_level = log_level;
+    exit (run_with_lease (lc.control_socket, with_lease, argv + optind));
+    }
+
   if (show_version)
     {
     printf (APPNAME " version " VERSION "\n");
@@ -232,35 +1234,142 @@ int main (int argc, char **argv)
   if (show_help)
     {
     printf ("Usage: " APPNAME " [-cdfhilsv]\n");
+    printf ("      --alarms        poll at once when a sensor alarm "
+            "goes off\n");
     printf ("  -c, --curve=name    fan curve name\n");
+    printf ("      --cpu-root=D    read CPU throttling from D,\n"
+            "                      not " CPU_ROOT "\n");
+    printf ("      --controller=C  'curve', or 'pid' to act on the rate "
+            "of rise\n");
+    printf ("      --ctl COMMAND   send a command to a running instance\n");
+    printf ("      --curve-file=F  read fan curves from F\n");
     printf ("  -d, --dry-run       don't change fan speed at all\n");
+    printf ("      --fan-file=F    control the fan using F,\n"
+            "                      not " FAN_FILE "\n");
     printf ("  -f, --foreground    run in foreground, and log to console\n");
     printf ("  -h, --help          show this message\n");
-    printf ("  -i, --interval=N    scan interval seconds (5)\n");
+    printf ("      --hwmon-root=D  read sensors from D, not " HWMON_ROOT "\n");
+    printf ("  -i, --interval=T    scan interval, e.g., 5, 5s, 250ms (5s)\n");
     printf ("  -l, --log-level=N   log verbosity 0-4 (2)\n");
+    printf ("      --load-boost=N  add N fan levels when CPU load steps up\n");
+    printf ("      --manifest=F    save the sensors found in F\n"
+            "                      (" SENSOR_MANIFEST ")\n");
+    printf ("      --min-interval=T  adapt interval, no shorter than T (1s)\n");
+    printf ("      --max-interval=T  adapt interval, no longer than T (30s)\n");
     printf ("      --no-wifi       don't include wifi adapters\n");
     printf ("      --no-drivetemp  don't include information from drivetemp\n");
+    printf ("      --no-throttle-boost  don't raise the fan when the CPU "
+            "throttles\n");
+    printf ("      --power-map=W1,W2,...  package power for each fan level\n");
+    printf ("      --powercap-root=D  read power from D,\n"
+            "                      not " POWERCAP_ROOT "\n");
+    printf ("      --record=F      append a trace of each poll to F\n");
+    printf ("      --replay=F      evaluate all fan curves against trace F\n");
+    printf ("      --rule=RULE     include or exclude sensors, e.g.,\n"
+            "                      'exclude driver=nvme "
+            "path=*0000:3d:00.0*'\n");
+    printf ("      --rules-file=F  read sensor rules from F,\n"
+            "                      not " RULES_FILE "\n");
+    printf ("      --slow-interval=T  storage sensor interval (30s)\n");
+    printf ("      --socket=F      control socket (" CONTROL_SOCKET ")\n");
+    printf ("      --stats         collect timing statistics\n");
+    printf ("      --status-page=F publish temperatures in F\n"
+            "                      (" STATUS_PAGE ")\n");
     printf ("  -s, --stop          stop a running instance\n");
+    printf ("      --target=T      temperature the pid controller aims "
+            "for (%d)\n", DEFAULT_PID_TARGET);
+    printf ("      --uevents=F     read hotplug events from FIFO F "
+            "(testing)\n");
+    printf ("      --uring         read sensors in batches using io_uring\n");
     printf ("  -v, --version       show version\n");
+    printf ("      --with-lease=L -- COMMAND  run COMMAND with the fan "
+            "at least\n                      at level L, or 'max'\n");
     exit (0);
     }
 
+  // A run against a fake hwmon tree keeps its files beside the tree, so it
+  //   doesn't overwrite those of the real daemon
+  if (!lc.manifest)
+    lc.manifest = run_file (lc.hwmon_root, SENSOR_MANIFEST, "sensors", 
+      manifest, sizeof (manifest));
+  if (!lc.status_page)
+    lc.status_page = run_file (lc.hwmon_root, STATUS_PAGE, "status", 
+      status_page, sizeof (status_page));
+
   mylog_level = log_level;
   // We need to set the logging to syslog quite early, because we test that
   // the fan can be controlled before going into the background. But we don't
   // want to do this at all, if we're staying in the foreground.
-  if (!foreground)
+  if (!foreground && !replay_file)
     mylog_syslog = TRUE;
 
-  mylog_info ("Starting with fan curve '%s'", curve_get_name (curve_num));
+  if (curve_init (curve_file) != 0) exit (0);
+  // Rules given on the command line come before those in the file
+  if (rules_load (&lc.rules, rules_file ? rules_file : RULES_FILE, 
+      rules_file != NULL) != 0) exit (0);
+  lc.curve = curve_from_name (curve_name);
+
+  if (strcmp (controller, "pid") == 0)
+    lc.predictive = TRUE;
+  else if (strcmp (controller, "curve") != 0)
+    {
+    mylog_error ("Unknown controller '%s': use 'curve' or 'pid'", controller);
+    exit (0);
+    }
+  if (lc.pid.target <= CURVE_TEMP_MIN || lc.pid.target > CURVE_TEMP_MAX)
+    {
+    mylog_error ("Invalid target temperature %d", lc.pid.target);
+    exit (0);
+    }
+
+  lc.adaptive = (min_interval_ms > 0 || max_interval_ms > 0);
+  if (lc.adaptive)
+    {
+    if (min_interval_ms <= 0) min_interval_ms = DEFAULT_MIN_INTERVAL_MS;
+    if (max_interval_ms <= 0) max_interval_ms = DEFAULT_MAX_INTERVAL_MS;
+    if (max_interval_ms < min_interval_ms)
+      {
+      mylog_error ("Invalid intervals: the maximum %dms is less than the "
+        "minimum %dms", max_interval_ms, min_interval_ms);
+      exit (0);
+      }
+    }
+
+  if (lc.load_levels < 0 || lc.load_levels > FAN_MAX)
+    {
+    mylog_error ("Invalid number of load boost levels %d", lc.load_levels);
+    exit (0);
+    }
+
+  if (power_map && power_parse_map (&lc.power, power_map) != 0)
+    {
+    mylog_error ("Invalid power map '%s': use increasing watts, e.g., "
+      "10,20,30", power_map);
+    exit (0);
+    }
+
+  if (replay_file)
+    exit (replay_run (replay_file, 0) == 0 ? 0 : 1);
+  // Open the trace before daemon() changes directory, in case its name is
+  //   relative
+  if (record_file && trace_open (record_file) != 0) exit (0);
+
+  mylog_info ("Starting with fan curve '%s'", curve_get_name (lc.curve));
 
   if (get_lock() == 0)
     {
     if (fan_to_manual (dry_run) == 0)
       {
-      signal (SIGINT, signal_quit);
-      signal (SIGQUIT, signal_quit);
-      signal (SIGTERM, signal_quit);
+      // Block the termination signals, so they are delivered to the main
+      //   loop's signalfd, rather than killing us in the middle of 
+      //   something. SIGUSR1 goes the same way.
+      sigset_t mask;
+      sigemptyset (&mask);
+      sigaddset (&mask, SIGINT);
+      sigaddset (&mask, SIGQUIT);
+      sigaddset (&mask, SIGTERM);
+      sigaddset (&mask, SIGUSR1);
+      sigprocmask (SIG_BLOCK, &mask, NULL);
 
       if (!foreground)
 	{
@@ -270,14 +1379,30 @@ int main (int argc, char **argv)
 	get_lock();
 	}
     
-      if (interval <= 0) interval = 5;
+      if (lc.adaptive)
+        {
+        adaptive_init (&lc.sched, min_interval_ms, max_interval_ms, 
+          lc.interval_ms);
+        lc.interval_ms = lc.sched.interval_ms;
+        mylog_info ("Adaptive polling between %dms and %dms", min_interval_ms,
+          max_interval_ms);
+        }
+
+      // The default control socket and the sensor manifest live in their
+      //   own directory 
+      mkdir (RUN_DIR, 0755);
 
-      main_loop (interval, curve_num, nowifi, nodrivetemp);
+      // From here, log messages are written out by a background thread,
+      //   so logging doesn't hold up the polls
+      mylog_async_start ();
+      main_loop (&lc);
 
-      // We don't normally get here
+      // Whatever stopped the loop, we restore the default fan behaviour
       mylog_info ("Finished");
       fan_to_auto (dry_run);
+      mylog_async_stop ();
       }
+    trace_close ();
     remove_lock();
     }
   else
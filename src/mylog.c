@@ -15,12 +15,64 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "defs.h"
+#include "config.h"
 #include "mylog.h"
 
 int mylog_level = MYLOG_INFO;
 int mylog_syslog = FALSE;
 
+/* Once mylog_async_start() has been called, messages are formatted into
+   a slot in a ring buffer, and written out by a background thread. So 
+   logging costs the caller a vsnprintf() and a few atomic operations -- 
+   no system calls, and no heap allocation. The ring can be filled by any
+   number of threads at once: a writer claims a slot by advancing ring_head,
+   and marks it full by setting the slot's sequence number. If the ring is
+   full, the message is dropped and counted. Messages longer than 
+   LOG_LINE_MAX are truncated. */
+
+typedef struct _LogSlot
+  {
+  unsigned seq; // Slot index + 1 when full; slot index + ring size when free
+  int level;
+  const char *fmt; // Identifies where in the code the message came from
+  char text[LOG_LINE_MAX];
+  } LogSlot;
+
+/* The last message from each place in the code, so that repeats of it can
+   be counted rather than logged. A place is identified by its format and 
+   level, since the linker merges identical format strings. */
+
+#define LOG_SITES 64
+
+typedef struct _LogSite
+  {
+  const char *fmt;
+  int level;
+  unsigned repeats; // Times the message has repeated since it was logged
+  uint64_t since; // When the first of those repeats was
+  char text[LOG_LINE_MAX];
+  } LogSite;
+
+static LogSlot ring[LOG_RING_SIZE];
+static unsigned ring_head = 0; // The next slot to fill
+static unsigned ring_tail = 0; // The next slot to write out
+static unsigned dropped = 0;
+static LogSite sites[LOG_SITES];
+static int nsites = 0;
+static int wake_fd = -1;
+static pthread_t flusher;
+static BOOL async = FALSE;
+static BOOL stopping = FALSE;
+// Console output is collected here, and written out in one go
+static char batch[8192];
+static int batch_len = 0;
+
 /*==========================================================================
 mylog_set_level
 *==========================================================================*/
@@ -30,40 +82,271 @@ void mylog_set_level (const int level)
   }
 
 /*==========================================================================
-mylog_vprintf
+level_name
 *==========================================================================*/
-void mylog_vprintf (const int level, const char *fmt, va_list ap)
+static const char *level_name (const int level)
   {
-  if (level > mylog_level) return;
+  switch (level)
+    {
+    case MYLOG_WARN: return "WARN";
+    case MYLOG_INFO: return "INFO";
+    case MYLOG_DEBUG: return "DEBUG";
+    case MYLOG_TRACE: return "TRACE";
+    }
+  return "ERROR";
+  }
+
+/*==========================================================================
+batch_flush
+*==========================================================================*/
+static void batch_flush (void)
+  {
+  if (batch_len == 0) return;
+  fwrite (batch, 1, batch_len, stderr);
+  fflush (stderr);
+  batch_len = 0;
+  }
 
+/*==========================================================================
+output
+Write one message to syslog or the console. If batching, console output
+is held until batch_flush().
+*==========================================================================*/
+static void output (const int level, const char *text, BOOL batching)
+  {
   if (mylog_syslog)
     {
     switch (level)
       {
-      case MYLOG_ERROR: vsyslog (LOG_ERR, fmt, ap); break;
-      case MYLOG_WARN: vsyslog (LOG_WARNING, fmt, ap); break;
-      case MYLOG_INFO: vsyslog (LOG_NOTICE, fmt, ap); break;
-      case MYLOG_DEBUG: vsyslog (LOG_DEBUG, fmt, ap); break;
+      case MYLOG_ERROR: syslog (LOG_ERR, "%s", text); break;
+      case MYLOG_WARN: syslog (LOG_WARNING, "%s", text); break;
+      case MYLOG_INFO: syslog (LOG_NOTICE, "%s", text); break;
+      case MYLOG_DEBUG: syslog (LOG_DEBUG, "%s", text); break;
       case MYLOG_TRACE: /* Ignore */; break;
       }
     }
+  else if (!batching)
+    fprintf (stderr, APPNAME " %s %s\n", level_name (level), text);
   else
     {
-    char *str = NULL;
-    vasprintf (&str, fmt, ap);
-    const char *levelstr = "ERROR";
-    if (level == MYLOG_WARN)
-      levelstr = "WARN";
-    else if (level == MYLOG_INFO)
-      levelstr = "INFO";
-    else if (level == MYLOG_DEBUG)
-      levelstr = "DEBUG";
-    else if (level == MYLOG_TRACE)
-      levelstr = "TRACE";
-    fprintf (stderr, APPNAME " %s %s\n", levelstr, str);
-    free (str);
+    char line[LOG_LINE_MAX + 32];
+    int n = snprintf (line, sizeof (line), APPNAME " %s %s\n", 
+      level_name (level), text);
+    if (n >= (int)sizeof (line)) n = sizeof (line) - 1;
+    if (batch_len + n > (int)sizeof (batch)) batch_flush ();
+    memcpy (batch + batch_len, line, n);
+    batch_len += n;
+    }
+  }
+
+/*==========================================================================
+now_ms
+*==========================================================================*/
+static uint64_t now_ms (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+/*==========================================================================
+report_repeats
+Log the number of times a site's last message has been repeated, if any.
+*==========================================================================*/
+static void report_repeats (LogSite *site)
+  {
+  if (site->repeats == 0) return;
+  char text[LOG_LINE_MAX + 32];
+  snprintf (text, sizeof (text), "%s (repeated %u times)", site->text, 
+    site->repeats);
+  output (site->level, text, TRUE);
+  site->repeats = 0;
+  }
+
+/*==========================================================================
+write_message
+Write out a message taken from the ring, unless it's the same as the last
+one from the same place in the code.
+*==========================================================================*/
+static void write_message (const LogSlot *slot, uint64_t now)
+  {
+  LogSite *site = NULL;
+  for (int i = 0; i < nsites && !site; i++)
+    if (sites[i].fmt == slot->fmt && sites[i].level == slot->level) 
+      site = &sites[i];
+  if (!site && nsites < LOG_SITES) 
+    {
+    site = &sites[nsites++];
+    site->fmt = slot->fmt;
+    site->repeats = 0;
+    site->level = slot->level;
+    site->text[0] = 0;
+    }
+  if (site && strcmp (site->text, slot->text) == 0)
+    {
+    if (site->repeats++ == 0) site->since = now;
+    return;
+    }
+  if (site)
+    {
+    report_repeats (site);
+    memcpy (site->text, slot->text, sizeof (site->text));
+    }
+  output (slot->level, slot->text, TRUE);
+  }
+
+/*==========================================================================
+drain
+Write out everything in the ring, and the counts of repeated messages that
+are due, or all of them if final is set. Only one thread calls this at a
+time.
+*==========================================================================*/
+static void drain (BOOL final)
+  {
+  uint64_t now = now_ms ();
+  while (1)
+    {
+    LogSlot *slot = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != ring_tail + 1) 
+      break;
+    write_message (slot, now);
+    __atomic_store_n (&slot->seq, ring_tail + LOG_RING_SIZE, 
+      __ATOMIC_RELEASE);
+    ring_tail++;
+    }
+  for (int i = 0; i < nsites; i++)
+    if (final || now - sites[i].since >= LOG_REPEAT_MS) 
+      report_repeats (&sites[i]);
+  unsigned lost = __atomic_exchange_n (&dropped, 0, __ATOMIC_RELAXED);
+  if (lost > 0)
+    {
+    char text[64];
+    snprintf (text, sizeof (text), "%u log messages were dropped", lost);
+    output (MYLOG_WARN, text, TRUE);
+    }
+  batch_flush ();
+  }
+
+/*==========================================================================
+flusher_thread
+*==========================================================================*/
+static void *flusher_thread (void *arg)
+  {
+  struct pollfd pfd;
+  pfd.fd = wake_fd;
+  pfd.events = POLLIN;
+  while (1)
+    {
+    if (poll (&pfd, 1, LOG_FLUSH_MS) > 0)
+      {
+      uint64_t count;
+      read (wake_fd, &count, sizeof (count));
+      }
+    BOOL stop = __atomic_load_n (&stopping, __ATOMIC_ACQUIRE);
+    drain (FALSE);
+    if (stop) break;
+    }
+  return NULL;
+  }
+
+/*==========================================================================
+ring_put
+Format a message into the next free slot. Returns FALSE if the ring is full.
+*==========================================================================*/
+static BOOL ring_put (const int level, const char *fmt, va_list ap)
+  {
+  unsigned pos = __atomic_load_n (&ring_head, __ATOMIC_RELAXED);
+  LogSlot *slot;
+  while (1)
+    {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    unsigned seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+    int diff = (int)(seq - pos);
+    if (diff == 0)
+      {
+      if (__atomic_compare_exchange_n (&ring_head, &pos, pos + 1, TRUE,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+      }
+    else if (diff < 0)
+      return FALSE;
+    else
+      pos = __atomic_load_n (&ring_head, __ATOMIC_RELAXED);
+    }
+  slot->level = level;
+  slot->fmt = fmt;
+  vsnprintf (slot->text, sizeof (slot->text), fmt, ap);
+  __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return TRUE;
+  }
+
+/*==========================================================================
+mylog_async_start
+Start writing log messages from a background thread. This must be called
+after daemon(), which doesn't keep threads. If the thread can't be started,
+messages are written straight away, as before.
+*==========================================================================*/
+int mylog_async_start (void)
+  {
+  if (async) return 0;
+  for (unsigned i = 0; i < LOG_RING_SIZE; i++) ring[i].seq = i;
+  ring_head = ring_tail = 0;
+  nsites = 0;
+  stopping = FALSE;
+  wake_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd < 0) return -1;
+  if (pthread_create (&flusher, NULL, flusher_thread, NULL) != 0)
+    {
+    close (wake_fd);
+    wake_fd = -1;
+    return -1;
+    }
+  __atomic_store_n (&async, TRUE, __ATOMIC_RELEASE);
+  return 0;
+  }
+
+/*==========================================================================
+mylog_async_stop
+Write out everything that is waiting, including counts of repeated 
+messages, stop the background thread, and go back to writing messages
+straight away.
+*==========================================================================*/
+void mylog_async_stop (void)
+  {
+  if (!async) return;
+  __atomic_store_n (&stopping, TRUE, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  write (wake_fd, &one, sizeof (one));
+  pthread_join (flusher, NULL);
+  __atomic_store_n (&async, FALSE, __ATOMIC_RELEASE);
+  drain (TRUE);
+  close (wake_fd);
+  wake_fd = -1;
+  }
+
+/*==========================================================================
+mylog_vprintf
+*==========================================================================*/
+void mylog_vprintf (const int level, const char *fmt, va_list ap)
+  {
+  if (level > mylog_level) return;
+
+  if (__atomic_load_n (&async, __ATOMIC_ACQUIRE))
+    {
+    if (!ring_put (level, fmt, ap))
+      __atomic_fetch_add (&dropped, 1, __ATOMIC_RELAXED);
+    // Errors and warnings are written out promptly; anything else waits
+    //   for the next batch
+    if (level <= MYLOG_WARN)
+      {
+      uint64_t one = 1;
+      write (wake_fd, &one, sizeof (one));
+      }
+    return;
     }
 
+  char text[LOG_LINE_MAX];
+  vsnprintf (text, sizeof (text), fmt, ap);
+  output (level, text, FALSE);
   }
 
 /*==========================================================================
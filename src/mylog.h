@@ -25,4 +25,6 @@ extern void mylog_info (const char *fmt,...);
 extern void mylog_debug (const char *fmt,...);
 extern void mylog_trace (const char *fmt,...);
 extern void mylog (int level, const char *fmt,...);
+extern int mylog_async_start (void);
+extern void mylog_async_stop (void);
 
@@ -0,0 +1,79 @@
+/*=============================================================================
+
+  p53-fan
+  p53-fan-status.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  The layout of the status page, which p53-fan updates at every poll, so
+  that other programs can see the thermal state without scanning hwmon 
+  themselves. This header is all a reader needs: map the file (normally
+  /run/p53-fan/status) read-only, check the magic, version and size, and 
+  then take copies with p53_status_read(). 
+
+  The page is guarded by a sequence lock. The writer makes seq odd before 
+  it changes anything, and even again afterwards, so a reader that sees 
+  the same even value of seq before and after its copy knows that the copy
+  is consistent. Readers never block the writer, and reading takes no 
+  system calls at all.
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define P53_STATUS_MAGIC "P53STAT"
+#define P53_STATUS_VERSION 1
+#define P53_STATUS_MAX_SENSORS 64
+
+// Sensor flags
+#define P53_STATUS_VALID 0x1 // The sensor has a temperature
+#define P53_STATUS_SLOW 0x2 // The sensor is read less often than the others
+
+typedef struct _P53StatusSensor
+  {
+  int32_t temp; // Degrees C
+  uint32_t flags;
+  uint64_t read_ns; // When it was read, CLOCK_MONOTONIC nanoseconds
+  char device[32]; // e.g., hwmon3
+  char driver[32]; // e.g., coretemp
+  char label[32]; // e.g., Package id 0
+  } P53StatusSensor;
+
+typedef struct _P53Status
+  {
+  char magic[8]; // P53_STATUS_MAGIC
+  uint32_t version; // P53_STATUS_VERSION
+  uint32_t size; // sizeof (P53Status)
+  uint32_t seq; // Odd while the page is being updated
+  uint32_t running; // 0 once p53-fan has stopped
+  uint64_t ticks; // Polls since p53-fan started
+  uint64_t updated_ns; // When the page was updated, CLOCK_MONOTONIC 
+  int32_t max_temp; // The temperature that decides the fan level
+  int32_t level; // The fan level, 0-8, where 8 is disengaged
+  char curve[32]; // The fan curve in use
+  uint32_t nsensors; // Entries used in sensors[]
+  uint32_t reserved;
+  P53StatusSensor sensors[P53_STATUS_MAX_SENSORS];
+  } P53Status;
+
+/**
+  p53_status_read
+
+  Take a consistent copy of the status page. Returns 0, or -1 if the page 
+kept changing (or the writer died half way through an update) and no
+consistent copy could be taken.
+*/
+static inline int p53_status_read (const P53Status *page, P53Status *copy)
+  {
+  for (int tries = 0; tries < 1000; tries++)
+    {
+    uint32_t seq = __atomic_load_n (&page->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) continue;
+    memcpy (copy, page, sizeof (*copy));
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&page->seq, __ATOMIC_RELAXED) == seq) return 0;
+    }
+  return -1;
+  }
@@ -0,0 +1,101 @@
+/*=============================================================================
+
+  p53-fan
+  pid.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  A predictive controller. The derivative term works as a feed-forward: we 
+  ask the fan curve for the level it would choose at the temperature we 
+  expect a few seconds from now, given the current rate of rise, so the
+  fan speeds up before the temperature crosses the curve's boundary rather
+  than after. The proportional and integral terms add levels on top, when 
+  the temperature is above a target, for however far above and however long
+  it has been there.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "defs.h"
+#include "mylog.h"
+#include "fan.h"
+#include "pid.h"
+
+// Weight of the newest sample in the smoothed slope
+#define PID_ALPHA 0.4
+// How far ahead we look, in seconds, at the current rate of rise
+#define PID_HORIZON 10.0
+// ... but we never look more than this many degrees ahead
+#define PID_LOOKAHEAD_MAX 10.0
+// Fan levels per degree above the target
+#define PID_KP 0.25
+// Fan levels per degree-second above the target
+#define PID_KI 0.005
+// The integral is kept between zero and the amount that gives full speed
+//   on its own, so it can't wind up while the fan is already flat out
+#define PID_INTEGRAL_MAX (FAN_MAX / PID_KI)
+// How far the correction has to move past the current value before we 
+//   change it, so the level doesn't flap between two values
+#define PID_HYSTERESIS 0.75
+
+/**
+  pid_init
+
+  Set up the controller, to keep the temperature below target.
+*/
+void pid_init (Pid *pid, int target)
+  {
+  pid->target = target;
+  pid->integral = 0;
+  pid->slope = 0;
+  pid->ahead_level = 0;
+  pid->boost = 0;
+  pid->have_last = FALSE;
+  }
+
+/**
+  pid_next
+
+  Work out a fan level, given the temperature just read at time now 
+(seconds, monotonic). With the temperature steady and below the target, this
+is just the curve's level, so the controller only ever asks for more 
+cooling than the curve would give. The caller uses whichever is higher.
+*/
+int pid_next (Pid *pid, const Curve *curve, double now, int temp)
+  {
+  int error = temp - pid->target;
+  if (pid->have_last && now > pid->last_time)
+    {
+    double dt = now - pid->last_time;
+    double slope = (temp - pid->last_temp) / dt;
+    pid->slope = PID_ALPHA * slope + (1 - PID_ALPHA) * pid->slope;
+    pid->integral += error * dt;
+    if (pid->integral < 0) pid->integral = 0;
+    if (pid->integral > PID_INTEGRAL_MAX) pid->integral = PID_INTEGRAL_MAX;
+    }
+  pid->last_temp = temp;
+  pid->last_time = now;
+  pid->have_last = TRUE;
+
+  // A falling temperature doesn't make us look behind: turning the fan 
+  //   down is left to the curve
+  double ahead = pid->slope > 0 ? pid->slope * PID_HORIZON : 0;
+  if (ahead > PID_LOOKAHEAD_MAX) ahead = PID_LOOKAHEAD_MAX;
+  int old_ahead_level = pid->ahead_level;
+  pid->ahead_level = curve_get_level (curve, pid->ahead_level, 
+    temp + (int)(ahead + 0.5));
+
+  double correction = PID_KP * error + PID_KI * pid->integral;
+  if (correction < 0) correction = 0;
+  int old_boost = pid->boost;
+  if (correction >= pid->boost + PID_HYSTERESIS 
+      || correction <= pid->boost - PID_HYSTERESIS)
+    pid->boost = (int)(correction + 0.5);
+
+  int level = pid->ahead_level + pid->boost;
+  if (level > FAN_MAX) level = FAN_MAX;
+  if (pid->boost != old_boost || pid->ahead_level != old_ahead_level)
+    mylog_debug ("PID level %d (slope %.2fC/s, %d above target, "
+      "integral %.0fC.s)", level, pid->slope, error, pid->integral);
+  return level;
+  }
@@ -0,0 +1,27 @@
+/*=============================================================================
+
+  p53-fan
+  pid.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+#include "curve.h"
+
+typedef struct _Pid
+  {
+  int target; // The temperature we try to stay below, C
+  double integral; // Accumulated error, C.sec
+  double slope; // Smoothed rate of change of temperature, C/sec
+  int ahead_level; // The curve's level for the predicted temperature
+  int boost; // Levels added for being above the target
+  int last_temp;
+  double last_time;
+  BOOL have_last;
+  } Pid;
+
+extern void pid_init (Pid *pid, int target);
+extern int pid_next (Pid *pid, const Curve *curve, double now, int temp);
@@ -0,0 +1,232 @@
+/*=============================================================================
+
+  p53-fan
+  power.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Package power from RAPL, as an input to the choice of fan level. Power 
+  rises the moment the load does, long before the heat reaches coretemp, 
+  so the fan can react to the cause rather than the symptom.
+
+  Each package has a directory /sys/class/powercap/intel-rapl:N (AMD CPUs
+  use the same name), whose 'name' file says 'package-N', with a counter 
+  energy_uj that counts up, in microjoules, to max_energy_range_uj and 
+  then wraps to zero. Power is the change in the counter between polls, 
+  divided by the time between them.
+  The counters stay open, and are read with pread(), so this is cheap 
+  enough to do at every poll.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include "defs.h"
+#include "config.h"
+#include "mylog.h"
+#include "power.h"
+
+// We only go down a level when the power is this many watts below the
+//   threshold, because package power is jumpy
+#define POWER_HYSTERESIS 3.0
+
+/**
+  read_counter
+
+  Read a decimal number from a sysfs file. Returns -1 if it can't be read.
+*/
+static int read_counter (int fd, uint64_t *value)
+  {
+  char buff[32];
+  int n = pread (fd, buff, sizeof (buff) - 1, 0);
+  if (n <= 0) return -1;
+  buff[n] = 0;
+  *value = strtoull (buff, NULL, 10);
+  return 0;
+  }
+
+/**
+  power_parse_map
+
+  Parse a power-to-level map, which is a comma-separated list of up to 
+eight increasing power levels in watts: the first is where fan level 1 
+starts, the second level 2, and so on. 'off' means don't use power at all.
+Returns -1 if the map is invalid, leaving the old one in place.
+*/
+int power_parse_map (Power *power, const char *map)
+  {
+  if (strcmp (map, "off") == 0)
+    {
+    power->nthresholds = 0;
+    return 0;
+    }
+  double thresholds[FAN_MAX];
+  int n = 0;
+  const char *p = map;
+  while (*p)
+    {
+    char *end;
+    double w = strtod (p, &end);
+    if (end == p || n == FAN_MAX || w <= 0 || (n > 0 && w <= thresholds[n - 1])
+        || (*end != ',' && *end != 0))
+      return -1;
+    thresholds[n++] = w;
+    p = *end ? end + 1 : end;
+    }
+  if (n == 0) return -1;
+  memcpy (power->thresholds, thresholds, sizeof (thresholds));
+  power->nthresholds = n;
+  return 0;
+  }
+
+/**
+  read_name
+
+  Read a zone's 'name' file, without the trailing newline. Returns -1 if
+it can't be read.
+*/
+static int read_name (const char *root, const char *zone, char *name, 
+         int len)
+  {
+  char path[512];
+  snprintf (path, sizeof (path), "%s/%s/name", root, zone);
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  int n = read (fd, name, len - 1);
+  close (fd);
+  if (n <= 0) return -1;
+  name[n] = 0;
+  name[strcspn (name, "\n")] = 0;
+  return 0;
+  }
+
+/**
+  power_init
+
+  Find the RAPL package domains under root (normally /sys/class/powercap),
+and open their energy counters. Subzones, like intel-rapl:0:0 for the 
+cores, are already counted in their package, so we ignore them. So are
+top-level zones that aren't packages: on many laptops, intel-rapl:1 is 
+'psys', the whole platform, which includes the package power already.
+Returns -1 (having logged the reason) if there are no package domains.
+*/
+int power_init (Power *power, const char *root)
+  {
+  power->ndomains = 0;
+  power->level = 0;
+  power->watts = 0;
+  power->have_last = FALSE;
+  DIR *d = opendir (root);
+  if (!d)
+    {
+    mylog_warn ("Can't open '%s': %s", root, strerror (errno));
+    return -1;
+    }
+  struct dirent *de;
+  while ((de = readdir (d)) && power->ndomains < POWER_MAX_DOMAINS)
+    {
+    const char *colon = strchr (de->d_name, ':');
+    if (strncmp (de->d_name, "intel-rapl:", 11) != 0 
+        || strchr (colon + 1, ':')) 
+      continue;
+    char name[32];
+    if (read_name (root, de->d_name, name, sizeof (name)) != 0)
+      strcpy (name, "?");
+    if (strncmp (name, "package-", 8) != 0)
+      {
+      mylog_info ("Ignoring RAPL zone '%s' (%s), which is not a package", 
+        de->d_name, name);
+      continue;
+      }
+    char path[512];
+    snprintf (path, sizeof (path), "%s/%s/max_energy_range_uj", root, 
+      de->d_name);
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    uint64_t max_uj = 0;
+    if (fd >= 0) read_counter (fd, &max_uj);
+    if (fd >= 0) close (fd);
+    snprintf (path, sizeof (path), "%s/%s/energy_uj", root, de->d_name);
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      {
+      mylog_warn ("Can't open '%s': %s", path, strerror (errno));
+      continue;
+      }
+    power->fds[power->ndomains] = fd;
+    power->max_uj[power->ndomains] = max_uj;
+    power->ndomains++;
+    mylog_debug ("Reading package power from '%s'", path);
+    }
+  closedir (d);
+  if (power->ndomains == 0)
+    {
+    mylog_warn ("No RAPL package power domains in '%s'", root);
+    return -1;
+    }
+  return 0;
+  }
+
+/**
+  power_level
+
+  Sample the package power at time now (stats_now() nanoseconds), and 
+return the fan level that the power map calls for, or zero if power is
+not in use. 
+*/
+int power_level (Power *power, uint64_t now)
+  {
+  if (power->nthresholds == 0 || power->ndomains == 0) return 0;
+  uint64_t uj[POWER_MAX_DOMAINS];
+  for (int i = 0; i < power->ndomains; i++)
+    if (read_counter (power->fds[i], &uj[i]) != 0) return power->level;
+
+  BOOL valid = power->have_last && now > power->last_time;
+  uint64_t total_uj = 0;
+  for (int i = 0; valid && i < power->ndomains; i++)
+    {
+    // The counter wraps to zero after max_energy_range_uj. If we couldn't
+    //   read that, there's no telling how much energy went by, so this
+    //   sample just becomes the start of the next
+    if (uj[i] >= power->last_uj[i])
+      total_uj += uj[i] - power->last_uj[i];
+    else if (power->max_uj[i] > power->last_uj[i])
+      total_uj += power->max_uj[i] - power->last_uj[i] + uj[i];
+    else
+      valid = FALSE;
+    }
+
+  if (valid)
+    {
+    power->watts = total_uj / ((now - power->last_time) / 1e3);
+
+    int level = 0;
+    while (level < power->nthresholds 
+        && power->watts >= power->thresholds[level])
+      level++;
+    // Going down, the power has to be clear of the threshold
+    while (level < power->level 
+        && power->watts >= power->thresholds[level] - POWER_HYSTERESIS)
+      level++;
+    if (level != power->level)
+      mylog_debug ("Package power %.1fW: level %d", power->watts, level);
+    power->level = level;
+    }
+  memcpy (power->last_uj, uj, power->ndomains * sizeof (uint64_t));
+  power->last_time = now;
+  power->have_last = TRUE;
+  return power->level;
+  }
+
+/**
+  power_done
+*/
+void power_done (Power *power)
+  {
+  for (int i = 0; i < power->ndomains; i++)
+    close (power->fds[i]);
+  power->ndomains = 0;
+  }
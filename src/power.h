@@ -0,0 +1,37 @@
+/*=============================================================================
+
+  p53-fan
+  power.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "fan.h"
+
+// The most RAPL package domains we read
+#define POWER_MAX_DOMAINS 8
+
+typedef struct _Power
+  {
+  // thresholds[i] is the package power, in watts, at which we want at least
+  //   fan level i + 1; nthresholds is zero if power is not used at all
+  int nthresholds;
+  double thresholds[FAN_MAX];
+  int level; // The level last chosen from the power
+  double watts; // Total package power over the last sample period
+  int ndomains;
+  int fds[POWER_MAX_DOMAINS]; // energy_uj of each package
+  uint64_t max_uj[POWER_MAX_DOMAINS]; // Where the counter wraps
+  uint64_t last_uj[POWER_MAX_DOMAINS];
+  uint64_t last_time; // stats_now() nanoseconds
+  BOOL have_last;
+  } Power;
+
+extern int power_parse_map (Power *power, const char *map);
+extern int power_init (Power *power, const char *root);
+extern int power_level (Power *power, uint64_t now);
+extern void power_done (Power *power);
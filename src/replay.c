@@ -0,0 +1,148 @@
+/*=============================================================================
+
+  p53-fan
+  replay.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Offline evaluation of fan curves against a recorded trace. Every curve
+  that is loaded is run over the whole trace, and we report how often it
+  changes the fan level, how long it spends at each level, and its worst
+  overshoot. Curves are shared out between threads, one per CPU by default.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "defs.h" 
+#include "mylog.h" 
+#include "fan.h" 
+#include "curve.h" 
+#include "stats.h" 
+#include "trace.h" 
+#include "replay.h" 
+
+typedef struct _ReplayResult
+  {
+  uint64_t transitions;
+  uint64_t time_ms[FAN_MAX + 1];
+  int overshoot; // The furthest the temperature went above the top of the
+                 //   range for the fan level in force, in degrees
+  } ReplayResult;
+
+typedef struct _ReplayJob
+  {
+  const TraceSamples *samples;
+  ReplayResult *results;
+  int ncurves;
+  int next; // The next curve to be replayed, shared by all the threads
+  } ReplayJob;
+
+/**
+  replay_curve
+
+  Run one curve over the trace, starting at fan level 3, as the daemon does.
+Ticks where no sensor could be read leave the level unchanged.
+*/
+static void replay_curve (const Curve *curve, const TraceSamples *samples,
+         ReplayResult *result)
+  {
+  uint64_t transitions = 0;
+  uint64_t time_ms[FAN_MAX + 1] = { 0 };
+  int overshoot = 0;
+  int level = 3;
+  int top[FAN_MAX + 1];
+  for (int i = 0; i <= FAN_MAX; i++)
+    {
+    int min;
+    curve_get_range (curve, i, &min, &top[i]);
+    }
+  for (int i = 0; i < samples->n; i++)
+    {
+    int temp = samples->temp[i];
+    if (temp != TRACE_NO_TEMP)
+      {
+      // Written without branches, which the CPU can't predict here
+      int over = temp - top[level];
+      overshoot = over > overshoot ? over : overshoot;
+      int new_level = curve_get_level (curve, level, temp);
+      transitions += (new_level != level);
+      level = new_level;
+      }
+    time_ms[level] += samples->duration_ms[i];
+    }
+  result->transitions = transitions;
+  memcpy (result->time_ms, time_ms, sizeof (time_ms));
+  result->overshoot = overshoot;
+  }
+
+/**
+  replay_thread
+*/
+static void *replay_thread (void *data)
+  {
+  ReplayJob *job = data;
+  while (1)
+    {
+    int c = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED);
+    if (c >= job->ncurves) break;
+    replay_curve (curve_get (c), job->samples, &job->results[c]);
+    }
+  return NULL;
+  }
+
+/**
+  replay_run
+
+  Replay the trace in the specified file against every fan curve, using
+the specified number of threads (zero for one per CPU), and print the
+results. Returns 0 on success.
+*/
+int replay_run (const char *filename, int threads)
+  {
+  TraceSamples samples;
+  if (trace_load (filename, &samples) != 0) return -1;
+
+  if (threads <= 0) threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (threads <= 0) threads = 1;
+  ReplayJob job;
+  job.samples = &samples;
+  job.ncurves = curve_get_count ();
+  job.results = calloc (job.ncurves, sizeof (ReplayResult));
+  job.next = 0;
+  if (threads > job.ncurves) threads = job.ncurves;
+
+  uint64_t start = stats_now ();
+  pthread_t *tids = calloc (threads, sizeof (pthread_t));
+  int started = 0;
+  for (int i = 1; i < threads; i++)
+    if (pthread_create (&tids[started], NULL, replay_thread, &job) == 0) 
+      started++;
+  replay_thread (&job);
+  for (int i = 0; i < started; i++)
+    pthread_join (tids[i], NULL);
+  uint64_t elapsed_ms = (stats_now () - start) / 1000000;
+
+  printf ("Replayed %d ticks (%.1f hours) against %d curves "
+    "on %d threads in %llums\n", samples.ticks, samples.total_ms / 3600000.0, 
+    job.ncurves, started + 1, (unsigned long long)elapsed_ms);
+  printf ("%-16s %11s %9s  %% of time at fan level 0-8\n", 
+    "curve", "transitions", "overshoot");
+  for (int c = 0; c < job.ncurves; c++)
+    {
+    const ReplayResult *r = &job.results[c];
+    printf ("%-16s %11llu %8dC ", curve_get_name (curve_get (c)), 
+      (unsigned long long)r->transitions, r->overshoot);
+    for (int i = 0; i <= FAN_MAX; i++)
+      printf (" %5.1f", samples.total_ms 
+        ? 100.0 * r->time_ms[i] / samples.total_ms : 0.0);
+    printf ("\n");
+    }
+
+  free (tids);
+  free (job.results);
+  trace_free (&samples);
+  return 0;
+  }
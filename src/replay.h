@@ -0,0 +1,11 @@
+/*=============================================================================
+
+  p53-fan
+  replay.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+extern int replay_run (const char *filename, int threads);
@@ -0,0 +1,197 @@
+/*=============================================================================
+
+  p53-fan
+  rpm.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Fan speed feedback. Writing a fan level doesn't tell us whether the fan 
+  actually runs at the speed it should -- a fan that is clogged with dust,
+  or failing, just makes the CPU throttle. So, after each change of level 
+  (once the fan has had time to settle), and every so often otherwise, the 
+  actuator reads the speed of each fan. From the checks that look 
+  healthy, we learn the speed to expect from each fan at each level. A fan
+  that doesn't turn at all, or turns at less than RPM_LOW_PERCENT of what
+  we expect, is failing. All the fans share one level, so if any of them
+  is failing, we run them a level higher than asked for and, if it's still
+  failing, disengaged. Once all the fans have been healthy for 
+  RPM_HOLD_MS, we step back down.
+
+  This module only does the arithmetic; the actuator thread reads the 
+  speed, and sets the fan.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include "defs.h"
+#include "config.h"
+#include "mylog.h"
+#include "rpm.h"
+
+/**
+  rpm_init
+*/
+void rpm_init (Rpm *rpm)
+  {
+  memset (rpm, 0, sizeof (Rpm));
+  rpm->level = -1;
+  for (int i = 0; i < FAN_SPEEDS_MAX; i++)
+    rpm->fans[i].speed = -1;
+  }
+
+/**
+  rpm_escalate
+
+  Returns the level to write to the fan, when the main loop asks for level.
+*/
+int rpm_escalate (const Rpm *rpm, int level)
+  {
+  if (rpm->escalation >= 2) return FAN_MAX;
+  level += rpm->escalation;
+  return level > FAN_MAX ? FAN_MAX : level;
+  }
+
+/**
+  rpm_written
+
+  Note that the fan has been set to level. If that's a change, check the 
+speed once the fan has settled.
+*/
+void rpm_written (Rpm *rpm, int level, uint64_t now)
+  {
+  if (level == rpm->level && rpm->check_at != 0) return;
+  rpm->level = level;
+  rpm->check_at = now + RPM_SETTLE_MS * 1000000ULL;
+  }
+
+/**
+  rpm_timeout_ms
+
+  Returns how long until the speed should next be checked, or -1 if there's
+nothing to check yet.
+*/
+int rpm_timeout_ms (const Rpm *rpm, uint64_t now)
+  {
+  if (rpm->check_at == 0) return -1;
+  if (now >= rpm->check_at) return 0;
+  return (int)((rpm->check_at - now + 999999) / 1000000);
+  }
+
+/**
+  learn
+
+  Add a healthy check to what we know about a fan at the current level. 
+The mean follows the fan as it ages, rather than averaging over all time.
+*/
+static void learn (RpmLevel *l, int speed)
+  {
+  l->n++;
+  l->mean += (speed - l->mean) / (l->n < 8 ? l->n : 8);
+  if (l->n == 1 || speed < l->min) l->min = speed;
+  if (l->n == 1 || speed > l->max) l->max = speed;
+  }
+
+/**
+  rpm_check
+
+  Consider a reading of the speed of each fan, which is -1 for a fan whose
+speed can't be read. Returns TRUE if the level written to the fans should 
+change, that is, if rpm_escalate() will now give a different answer.
+*/
+BOOL rpm_check (Rpm *rpm, const int *speeds, int nfans, uint64_t now)
+  {
+  rpm->check_at = now + RPM_CHECK_MS * 1000000ULL;
+  if (rpm->level < 0) return FALSE;
+  if (nfans > FAN_SPEEDS_MAX) nfans = FAN_SPEEDS_MAX;
+  if (nfans > rpm->nfans) rpm->nfans = nfans;
+
+  int failed = -1; // The first fan that is failing
+  char expected[32] = "";
+  for (int i = 0; i < nfans; i++)
+    {
+    if (speeds[i] < 0) continue;
+    RpmFan *fan = &rpm->fans[i];
+    fan->speed = speeds[i];
+    RpmLevel *l = &fan->levels[rpm->level];
+    BOOL learned = (l->n >= RPM_LEARN_SAMPLES);
+    BOOL failing = rpm->level > 0 && (speeds[i] == 0 
+      || (learned && speeds[i] * 100.0 < l->mean * RPM_LOW_PERCENT));
+    if (!failing)
+      {
+      learn (l, speeds[i]);
+      continue;
+      }
+    l->faults++;
+    fan->faults++;
+    if (failed >= 0) continue;
+    failed = i;
+    if (learned) 
+      snprintf (expected, sizeof (expected), " (expected %.0f)", l->mean);
+    }
+
+  if (failed < 0)
+    {
+    if (rpm->escalation > 0 && now - rpm->last_fault 
+        >= RPM_HOLD_MS * 1000000ULL)
+      {
+      rpm->escalation--;
+      mylog_info ("Fan speeds have been normal for %ds", RPM_HOLD_MS / 1000);
+      return TRUE;
+      }
+    return FALSE;
+    }
+
+  rpm->faults++;
+  rpm->last_fault = now;
+  if (rpm->escalation < 2)
+    {
+    rpm->escalation++;
+    mylog_warn ("Fan %d is at %d RPM at level %d%s: running the fans %s", 
+      failed + 1, speeds[failed], rpm->level, expected, 
+      rpm->escalation == 1 ? "a level higher" : "disengaged");
+    // Check again once the fans have settled at their new level
+    rpm->check_at = now + RPM_SETTLE_MS * 1000000ULL;
+    return TRUE;
+    }
+  mylog_error ("Fan %d is at %d RPM at level %d%s: it may have failed", 
+    failed + 1, speeds[failed], rpm->level, expected);
+  return FALSE;
+  }
+
+/**
+  rpm_format_speeds
+
+  Format the last speed read from each fan, separated by commas, or '-1' if
+we have none.
+*/
+void rpm_format_speeds (const Rpm *rpm, char *buff, int len)
+  {
+  int n = snprintf (buff, len, "%d", rpm->nfans ? rpm->fans[0].speed : -1);
+  for (int i = 1; i < rpm->nfans && n < len; i++)
+    n += snprintf (buff + n, len - n, ",%d", rpm->fans[i].speed);
+  }
+
+/**
+  rpm_format
+
+  Format the fan speed statistics: the overall state, then one line for 
+each level we've checked, for each fan.
+*/
+void rpm_format (const Rpm *rpm, char *buff, int len)
+  {
+  char speeds[64];
+  rpm_format_speeds (rpm, speeds, sizeof (speeds));
+  int n = snprintf (buff, len, "rpm=%s faults=%u escalation=%d", 
+    speeds, rpm->faults, rpm->escalation);
+  for (int f = 0; f < rpm->nfans; f++)
+    {
+    for (int i = 0; i <= FAN_MAX && n < len; i++)
+      {
+      const RpmLevel *l = &rpm->fans[f].levels[i];
+      if (l->n == 0 && l->faults == 0) continue;
+      n += snprintf (buff + n, len - n, 
+        "\nfan %d level %d: n=%u mean=%.0f min=%d max=%d faults=%u", 
+        f + 1, i, l->n, l->mean, l->min, l->max, l->faults);
+      }
+    }
+  }
@@ -0,0 +1,50 @@
+/*=============================================================================
+
+  p53-fan
+  rpm.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "fan.h"
+
+// What we've learned about the fan speed at one level
+typedef struct _RpmLevel
+  {
+  unsigned n; // Healthy checks at this level
+  double mean; // Their mean RPM, which is what we expect
+  int min;
+  int max;
+  unsigned faults; // Checks at this level that found the fan too slow
+  } RpmLevel;
+
+// What we've learned about one fan
+typedef struct _RpmFan
+  {
+  RpmLevel levels[FAN_MAX + 1];
+  int speed; // The last RPM read, or -1
+  unsigned faults;
+  } RpmFan;
+
+typedef struct _Rpm
+  {
+  RpmFan fans[FAN_SPEEDS_MAX];
+  int nfans; // The number of fans we've had readings for
+  int level; // The level last written to the fans
+  int escalation; // 0, 1 for a level higher, or 2 for disengaged
+  uint64_t check_at; // When to next read the speeds, in stats_now() ns
+  uint64_t last_fault;
+  unsigned faults; // Checks that found any fan too slow
+  } Rpm;
+
+extern void rpm_init (Rpm *rpm);
+extern int rpm_escalate (const Rpm *rpm, int level);
+extern void rpm_written (Rpm *rpm, int level, uint64_t now);
+extern int rpm_timeout_ms (const Rpm *rpm, uint64_t now);
+extern BOOL rpm_check (Rpm *rpm, const int *speeds, int nfans, uint64_t now);
+extern void rpm_format_speeds (const Rpm *rpm, char *buff, int len);
+extern void rpm_format (const Rpm *rpm, char *buff, int len);
@@ -0,0 +1,283 @@
+/*=============================================================================
+
+  p53-fan
+  rules.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Sensor selection rules. Each rule includes or excludes the sensors whose
+  driver name, label, and device path match its globs, for example:
+
+    exclude driver=nvme path=*0000:3d:00.0*
+    include driver=it87 label=temp3 offset=-5
+    include driver=coretemp label="Package id *"
+
+  A glob that isn't given matches anything. The first rule that matches a
+  sensor decides whether it's included; a sensor that matches no rule is
+  excluded. The user's rules come before the built-in ones, which select
+  the sensors that p53-fan has always used, so the user's rules can add to 
+  them or override them. --no-wifi and --no-drivetemp are just exclude 
+  rules that come before everything else.
+
+  The rules are only used when a hwmon device is added to the sensor table,
+  never in a poll.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include "defs.h"
+#include "mylog.h"
+#include "rules.h"
+
+#define RULE_GLOB_ANY 0 // '*', or no glob at all
+#define RULE_GLOB_EXACT 1 // No wildcards
+#define RULE_GLOB_PREFIX 2 // Only a trailing '*'
+#define RULE_GLOB_FULL 3 // Anything else, which needs fnmatch()
+
+// What p53-fan includes if the user has no rules of their own
+static const char *default_rules[] = 
+  {
+  "include driver=iwlwifi*", // The wifi adapter
+  "include driver=coretemp*", // All the CPU cores
+  "include driver=thinkpad* label=CPU*", // CPU and GPU from thinkpad_acpi
+  "include driver=thinkpad* label=GPU*",
+  "include driver=nvme* label=Composite*", // NVME drives, overall figure
+  "include driver=drivetemp*", // Usually SATA drives
+  NULL
+  };
+
+/**
+  glob_compile
+
+  Classify a glob, so that rules_match() can use the cheapest test for it.
+Returns -1 if the glob is too long.
+*/
+static int glob_compile (RuleGlob *glob, const char *text)
+  {
+  int len = strlen (text);
+  if (len >= RULE_TEXT_MAX) return -1;
+  strcpy (glob->text, text);
+  glob->len = len;
+  const char *wild = strpbrk (text, "*?[\\");
+  if (len == 0 || strcmp (text, "*") == 0)
+    glob->kind = RULE_GLOB_ANY;
+  else if (!wild)
+    glob->kind = RULE_GLOB_EXACT;
+  else if (wild == text + len - 1 && *wild == '*')
+    {
+    glob->kind = RULE_GLOB_PREFIX;
+    glob->len = len - 1;
+    }
+  else
+    glob->kind = RULE_GLOB_FULL;
+  return 0;
+  }
+
+/**
+  glob_match
+*/
+static BOOL glob_match (const RuleGlob *glob, const char *s)
+  {
+  switch (glob->kind)
+    {
+    case RULE_GLOB_ANY: return TRUE;
+    case RULE_GLOB_EXACT: return strcmp (glob->text, s) == 0;
+    case RULE_GLOB_PREFIX: return strncmp (glob->text, s, glob->len) == 0;
+    }
+  return fnmatch (glob->text, s, 0) == 0;
+  }
+
+/**
+  next_word
+
+  Copy the next space-separated word from *p into word, and advance *p past
+it. Double quotes group words that contain spaces. Returns FALSE at the end
+of the line.
+*/
+static BOOL next_word (const char **p, char *word, int len)
+  {
+  const char *s = *p;
+  while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
+  if (*s == 0) return FALSE;
+  int n = 0;
+  BOOL quoted = FALSE;
+  while (*s && (quoted || (*s != ' ' && *s != '\t' && *s != '\n' 
+      && *s != '\r')))
+    {
+    if (*s == '"')
+      quoted = !quoted;
+    else if (n < len - 1)
+      word[n++] = *s;
+    s++;
+    }
+  word[n] = 0;
+  *p = s;
+  return TRUE;
+  }
+
+/**
+  add_rule
+*/
+static int add_rule (SensorRules *rules, const SensorRule *rule)
+  {
+  SensorRule *new_rules = realloc (rules->rules, 
+    (rules->n + 1) * sizeof (SensorRule));
+  if (!new_rules) return -1;
+  rules->rules = new_rules;
+  rules->rules[rules->n++] = *rule;
+  return 0;
+  }
+
+/**
+  hash_text
+
+  Fold some text into the rules' hash (FNV-1a).
+*/
+static void hash_text (SensorRules *rules, const char *text)
+  {
+  for (const char *p = text; *p; p++)
+    rules->hash = (rules->hash ^ (unsigned char)*p) * 16777619u;
+  rules->hash = (rules->hash ^ '\n') * 16777619u;
+  }
+
+/**
+  rules_parse
+
+  Add one rule, in the form 'include|exclude [driver=G] [label=G] [path=G]
+[offset=N]', to the end of the rules. Blank lines and anything after '#' 
+are ignored. Returns -1 if the rule is invalid.
+*/
+int rules_parse (SensorRules *rules, const char *line)
+  {
+  char text[256];
+  strncpy (text, line, sizeof (text) - 1);
+  text[sizeof (text) - 1] = 0;
+  char *hash = strchr (text, '#');
+  if (hash) *hash = 0;
+
+  const char *p = text;
+  char word[RULE_TEXT_MAX + 16];
+  if (!next_word (&p, word, sizeof (word))) return 0; // Blank
+  SensorRule rule;
+  memset (&rule, 0, sizeof (rule));
+  if (strcmp (word, "include") == 0)
+    rule.include = TRUE;
+  else if (strcmp (word, "exclude") != 0)
+    return -1;
+  while (next_word (&p, word, sizeof (word)))
+    {
+    char *value = strchr (word, '=');
+    if (!value) return -1;
+    *value++ = 0;
+    int ret = 0;
+    if (strcmp (word, "driver") == 0)
+      ret = glob_compile (&rule.driver, value);
+    else if (strcmp (word, "label") == 0)
+      ret = glob_compile (&rule.label, value);
+    else if (strcmp (word, "path") == 0)
+      ret = glob_compile (&rule.path, value);
+    else if (strcmp (word, "offset") == 0)
+      {
+      char *end;
+      rule.offset = strtol (value, &end, 10);
+      if (end == value || *end != 0 || rule.offset < -50 || rule.offset > 50)
+        ret = -1;
+      }
+    else
+      ret = -1;
+    if (ret != 0) return -1;
+    }
+  hash_text (rules, text);
+  return add_rule (rules, &rule);
+  }
+
+/**
+  rules_load
+
+  Read rules from a file, one per line, and add them to the end of the 
+rules. Returns 0 if the file was read and all its rules are valid. If the 
+file does not exist, that's only an error if must_exist is TRUE.
+*/
+int rules_load (SensorRules *rules, const char *filename, BOOL must_exist)
+  {
+  FILE *f = fopen (filename, "r");
+  if (!f)
+    {
+    if (!must_exist && errno == ENOENT) return 0;
+    mylog_error ("Can't open sensor rules '%s': %s", filename, 
+      strerror (errno));
+    return -1;
+    }
+  int ret = 0;
+  char line[256];
+  int line_num = 0;
+  while (ret == 0 && fgets (line, sizeof (line), f))
+    {
+    line_num++;
+    if (rules_parse (rules, line) != 0)
+      {
+      line[strcspn (line, "\n")] = 0;
+      mylog_error ("%s:%d: invalid rule '%s'", filename, line_num, line);
+      ret = -1;
+      }
+    }
+  fclose (f);
+  return ret;
+  }
+
+/**
+  rules_compile
+
+  Build the complete set of rules: the exclusions for --no-wifi and 
+--no-drivetemp, then the user's rules (which may be NULL), then the 
+built-in ones. 
+*/
+void rules_compile (SensorRules *rules, const SensorRules *user, 
+         BOOL nowifi, BOOL nodrivetemp)
+  {
+  rules_free (rules);
+  rules->hash = 2166136261u;
+  if (nowifi) rules_parse (rules, "exclude driver=iwlwifi*");
+  if (nodrivetemp) rules_parse (rules, "exclude driver=drivetemp*");
+  if (user)
+    {
+    for (int i = 0; i < user->n; i++)
+      add_rule (rules, &user->rules[i]);
+    rules->hash = (rules->hash ^ user->hash) * 16777619u;
+    }
+  for (int i = 0; default_rules[i]; i++)
+    rules_parse (rules, default_rules[i]);
+  }
+
+/**
+  rules_match
+
+  Returns the first rule that matches a sensor, or NULL if none does. path
+is the device's path under /sys/devices.
+*/
+const SensorRule *rules_match (const SensorRules *rules, const char *driver,
+         const char *label, const char *path)
+  {
+  for (int i = 0; i < rules->n; i++)
+    {
+    const SensorRule *rule = &rules->rules[i];
+    if (glob_match (&rule->driver, driver) && glob_match (&rule->label, label)
+        && glob_match (&rule->path, path)) 
+      return rule;
+    }
+  return NULL;
+  }
+
+/**
+  rules_free
+*/
+void rules_free (SensorRules *rules)
+  {
+  free (rules->rules);
+  rules->rules = NULL;
+  rules->n = 0;
+  rules->hash = 2166136261u;
+  }
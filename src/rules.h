@@ -0,0 +1,49 @@
+/*=============================================================================
+
+  p53-fan
+  rules.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+#define RULE_TEXT_MAX 64
+
+// A glob, classified when it's compiled so that the common cases don't 
+//   need fnmatch()
+typedef struct _RuleGlob
+  {
+  int kind; // RULE_GLOB_ANY, RULE_GLOB_EXACT, etc., in rules.c
+  int len; // Length of text, without any trailing '*'
+  char text[RULE_TEXT_MAX];
+  } RuleGlob;
+
+// One line of the rules: include or exclude sensors that match all three
+//   globs, adding offset to the temperature of those included
+typedef struct _SensorRule
+  {
+  BOOL include;
+  int offset;
+  RuleGlob driver;
+  RuleGlob label;
+  RuleGlob path;
+  } SensorRule;
+
+typedef struct _SensorRules
+  {
+  int n;
+  SensorRule *rules;
+  unsigned hash; // Changes whenever the rules do
+  } SensorRules;
+
+extern int rules_parse (SensorRules *rules, const char *line);
+extern int rules_load (SensorRules *rules, const char *filename, 
+         BOOL must_exist);
+extern void rules_compile (SensorRules *rules, const SensorRules *user, 
+         BOOL nowifi, BOOL nodrivetemp);
+extern const SensorRule *rules_match (const SensorRules *rules, 
+         const char *driver, const char *label, const char *path);
+extern void rules_free (SensorRules *rules);
@@ -0,0 +1,79 @@
+/*=============================================================================
+
+  p53-fan
+  stats.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "defs.h"
+#include "stats.h"
+
+BOOL stats_enabled = FALSE;
+
+/**
+  stats_now
+  Return a monotonic timestamp in nanoseconds.
+*/
+uint64_t stats_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+/**
+  histogram_add
+  Add one time, in nanoseconds, to a histogram.
+*/
+void histogram_add (Histogram *h, uint64_t ns)
+  {
+  uint64_t us = ns / 1000;
+  int bucket = us ? 64 - __builtin_clzll (us) : 0;
+  if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+  h->counts[bucket]++;
+  h->n++;
+  h->total_ns += ns;
+  if (ns > h->max_ns) h->max_ns = ns;
+  }
+
+/**
+  percentile
+  Return the upper bound, in microseconds, of the bucket that contains the
+specified percentile.
+*/
+static unsigned int percentile (const Histogram *h, int pc)
+  {
+  unsigned int target = (h->n * (uint64_t)pc + 99) / 100;
+  unsigned int seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+    seen += h->counts[i];
+    if (seen >= target) return 1u << i;
+    }
+  return 1u << (STATS_BUCKETS - 1);
+  }
+
+/**
+  histogram_format
+  Format a one-line summary of a histogram: the number of samples, the mean
+and maximum, and the 50th and 99th percentiles. Percentiles are only 
+accurate to the width of a bucket, so they are shown as upper bounds.
+*/
+void histogram_format (const Histogram *h, const char *name, char *buff, 
+       int len)
+  {
+  if (h->n == 0)
+    {
+    snprintf (buff, len, "%s: no samples", name);
+    return;
+    }
+  snprintf (buff, len, "%s: n=%u mean=%lluus max=%lluus p50<%uus p99<%uus", 
+    name, h->n, (unsigned long long)(h->total_ns / h->n / 1000), 
+    (unsigned long long)(h->max_ns / 1000), percentile (h, 50), 
+    percentile (h, 99));
+  }
+
@@ -0,0 +1,34 @@
+/*=============================================================================
+
+  p53-fan
+  stats.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+// Bucket 0 counts times under 1us; bucket N counts times from 2^(N-1) to
+//   2^N us; the last bucket counts everything longer
+#define STATS_BUCKETS 20
+
+typedef struct _Histogram
+  {
+  unsigned int counts[STATS_BUCKETS];
+  unsigned int n;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  } Histogram;
+
+// Timing is only done when this is TRUE. Callers should test it before 
+//   calling stats_now(), so that timing costs nothing when it's disabled.
+extern BOOL stats_enabled;
+
+extern uint64_t stats_now (void);
+extern void histogram_add (Histogram *h, uint64_t ns);
+extern void histogram_format (const Histogram *h, const char *name, 
+         char *buff, int len);
+
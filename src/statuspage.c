@@ -0,0 +1,146 @@
+/*=============================================================================
+
+  p53-fan
+  statuspage.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  The status page: a small file, mapped into memory, that holds the latest
+  temperatures and fan level, for other programs to read (see 
+  p53-fan-status.h). Updating it is just a few stores to memory -- no system
+  calls -- so it costs nothing noticeable at each poll.
+
+  The file isn't removed when the program stops, because a reader may have
+  it mapped; instead, it's marked as not running. The next start reuses
+  the same file, so a reader that keeps it mapped sees the new instance.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "defs.h"
+#include "mylog.h"
+#include "stats.h"
+#include "statuspage.h"
+#include "p53-fan-status.h"
+
+static P53Status *page = NULL;
+
+/**
+  begin_update
+
+  Make the sequence number odd, so readers know the page is changing. The
+fence stops any of the following stores being seen before this one.
+*/
+static void begin_update (void)
+  {
+  __atomic_store_n (&page->seq, page->seq | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  }
+
+/**
+  end_update
+
+  Make the sequence number even again, and different from what it was 
+before the update.
+*/
+static void end_update (void)
+  {
+  __atomic_store_n (&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+  }
+
+/**
+  statuspage_open
+
+  Create the status page, or reuse it if it's left over from an earlier 
+run. Returns 0 if the page is ready to be updated.
+*/
+int statuspage_open (const char *filename)
+  {
+  int fd = open (filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || ftruncate (fd, sizeof (P53Status)) != 0)
+    {
+    mylog_warn ("Can't create status page '%s': %s", filename, 
+      strerror (errno));
+    if (fd >= 0) close (fd);
+    return -1;
+    }
+  void *p = mmap (NULL, sizeof (P53Status), PROT_READ | PROT_WRITE, 
+    MAP_SHARED, fd, 0);
+  close (fd);
+  if (p == MAP_FAILED)
+    {
+    mylog_warn ("Can't map status page '%s': %s", filename, 
+      strerror (errno));
+    return -1;
+    }
+  page = p;
+  // Keep the sequence number going from the last run, in case a reader 
+  //   is in the middle of a copy
+  begin_update ();
+  size_t keep = offsetof (P53Status, running);
+  memset ((char *)page + keep, 0, sizeof (P53Status) - keep);
+  memcpy (page->magic, P53_STATUS_MAGIC, sizeof (page->magic));
+  page->version = P53_STATUS_VERSION;
+  page->size = sizeof (P53Status);
+  page->running = 1;
+  page->level = -1;
+  end_update ();
+  mylog_debug ("Status page is '%s'", filename);
+  return 0;
+  }
+
+/**
+  statuspage_update
+
+  Publish the result of a poll: the fan level and curve, and the 
+temperature of every sensor in the table.
+*/
+void statuspage_update (int level, const char *curve, 
+         const HSContext *context)
+  {
+  if (!page) return;
+  int n = context->nsensors;
+  if (n > P53_STATUS_MAX_SENSORS) n = P53_STATUS_MAX_SENSORS;
+  begin_update ();
+  page->ticks++;
+  page->updated_ns = stats_now ();
+  page->max_temp = context->max_temp;
+  page->level = level;
+  strncpy (page->curve, curve, sizeof (page->curve) - 1);
+  page->nsensors = n;
+  for (int i = 0; i < n; i++)
+    {
+    const HSSensor *s = &context->sensors[i];
+    const HSDevice *d = &context->devices[s->device];
+    P53StatusSensor *ps = &page->sensors[i];
+    ps->temp = s->temp;
+    ps->flags = (s->have_temp ? P53_STATUS_VALID : 0) 
+      | (s->slow ? P53_STATUS_SLOW : 0);
+    ps->read_ns = s->last_read;
+    // These are the same size in the sensor table
+    memcpy (ps->device, d->name, sizeof (ps->device));
+    memcpy (ps->driver, d->driver, sizeof (ps->driver));
+    memcpy (ps->label, s->label, sizeof (ps->label));
+    }
+  end_update ();
+  }
+
+/**
+  statuspage_close
+
+  Mark the page as no longer being updated, and unmap it.
+*/
+void statuspage_close (void)
+  {
+  if (!page) return;
+  begin_update ();
+  page->running = 0;
+  end_update ();
+  munmap (page, sizeof (P53Status));
+  page = NULL;
+  }
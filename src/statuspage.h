@@ -0,0 +1,17 @@
+/*=============================================================================
+
+  p53-fan
+  statuspage.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+#include "hwmon_scan.h"
+
+extern int statuspage_open (const char *filename);
+extern void statuspage_update (int level, const char *curve, 
+         const HSContext *context);
+extern void statuspage_close (void);
@@ -0,0 +1,224 @@
+/*=============================================================================
+
+  p53-fan
+  throttle.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Detection of thermal throttling. On Intel CPUs, each CPU has a directory
+  /sys/devices/system/cpu/cpuN/thermal_throttle, with a count of the times
+  the core has been throttled (core_throttle_count), and of the times its
+  package has been (package_throttle_count). Every CPU in a package shows
+  the same package count, and the hyperthreads of a core show the same
+  core count, so we only read each from the first CPU we find in its 
+  package or core. Otherwise, one throttling episode would be counted 
+  once per thread. The counters stay open, and are read with pread().
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include "defs.h"
+#include "config.h"
+#include "mylog.h"
+#include "throttle.h"
+
+// The most CPU packages, and cores in all packages, we expect
+#define THROTTLE_MAX_PACKAGES 64
+#define THROTTLE_MAX_CORES 1024
+
+/**
+  read_count
+
+  Read a decimal counter from a sysfs file. Returns -1 if it can't be read.
+*/
+static int read_count (int fd, uint64_t *value)
+  {
+  char buff[32];
+  int n = pread (fd, buff, sizeof (buff) - 1, 0);
+  if (n <= 0) return -1;
+  buff[n] = 0;
+  *value = strtoull (buff, NULL, 10);
+  return 0;
+  }
+
+/**
+  read_topology
+
+  Read one of a CPU's topology files, e.g., core_id. Returns 0 if it can't
+be read, which is what a single-core machine would say anyway.
+*/
+static int read_topology (const char *root, const char *cpu, 
+         const char *file)
+  {
+  char path[512];
+  snprintf (path, sizeof (path), "%s/%s/topology/%s", root, cpu, file);
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  uint64_t id = 0;
+  if (fd >= 0) read_count (fd, &id);
+  if (fd >= 0) close (fd);
+  return (int)id;
+  }
+
+/**
+  add_counter
+
+  Open a counter file, and add it to the table with its current value.
+*/
+static void add_counter (Throttle *throttle, const char *path, BOOL package)
+  {
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  ThrottleCounter *counters = realloc (throttle->counters, 
+    (throttle->n + 1) * sizeof (ThrottleCounter));
+  if (!counters)
+    {
+    close (fd);
+    return;
+    }
+  throttle->counters = counters;
+  ThrottleCounter *c = &counters[throttle->n++];
+  c->fd = fd;
+  c->package = package;
+  c->count = 0;
+  read_count (fd, &c->count);
+  }
+
+/**
+  throttle_init
+
+  Find and open the throttle counters of all the CPUs under root (normally
+/sys/devices/system/cpu). Returns -1 (having logged the reason) if there 
+are none, as on CPUs that don't report throttling.
+*/
+int throttle_init (Throttle *throttle, const char *root)
+  {
+  memset (throttle, 0, sizeof (Throttle));
+  DIR *d = opendir (root);
+  if (!d)
+    {
+    mylog_warn ("Can't open '%s': %s", root, strerror (errno));
+    return -1;
+    }
+  int packages[THROTTLE_MAX_PACKAGES];
+  int npackages = 0;
+  // Cores are numbered within their package
+  struct { int package, core; } cores[THROTTLE_MAX_CORES];
+  int ncores = 0;
+  struct dirent *de;
+  while ((de = readdir (d)))
+    {
+    if (strncmp (de->d_name, "cpu", 3) != 0 
+        || de->d_name[3] < '0' || de->d_name[3] > '9') 
+      continue;
+    int package = read_topology (root, de->d_name, "physical_package_id");
+    int core = read_topology (root, de->d_name, "core_id");
+    char path[512];
+
+    // Only the first CPU in each core gives us the core count
+    BOOL seen = FALSE;
+    for (int i = 0; i < ncores; i++)
+      if (cores[i].package == package && cores[i].core == core) seen = TRUE;
+    if (!seen && ncores < THROTTLE_MAX_CORES)
+      {
+      cores[ncores].package = package;
+      cores[ncores++].core = core;
+      snprintf (path, sizeof (path), 
+        "%s/%s/thermal_throttle/core_throttle_count", root, de->d_name);
+      add_counter (throttle, path, FALSE);
+      }
+
+    // ... and the first CPU in each package gives us the package count
+    seen = FALSE;
+    for (int i = 0; i < npackages; i++)
+      if (packages[i] == package) seen = TRUE;
+    if (seen || npackages == THROTTLE_MAX_PACKAGES) continue;
+    packages[npackages++] = package;
+    snprintf (path, sizeof (path), 
+      "%s/%s/thermal_throttle/package_throttle_count", root, de->d_name);
+    add_counter (throttle, path, TRUE);
+    }
+  closedir (d);
+
+  if (throttle->n == 0)
+    {
+    mylog_info ("No thermal throttling information in '%s'", root);
+    return -1;
+    }
+  mylog_debug ("Watching %d throttle counters, for %d cores in %d packages", 
+    throttle->n, ncores, npackages);
+  return 0;
+  }
+
+/**
+  throttle_poll
+
+  Read all the counters at time now (stats_now() nanoseconds), and count 
+any new throttle events. Returns TRUE if there have been any in the last
+THROTTLE_HOLD_MS.
+*/
+BOOL throttle_poll (Throttle *throttle, uint64_t now)
+  {
+  uint64_t events = 0;
+  for (int i = 0; i < throttle->n; i++)
+    {
+    ThrottleCounter *c = &throttle->counters[i];
+    uint64_t count;
+    if (read_count (c->fd, &count) != 0) continue;
+    if (count > c->count)
+      {
+      events += count - c->count;
+      if (c->package)
+        throttle->package_events += count - c->count;
+      else
+        throttle->core_events += count - c->count;
+      }
+    c->count = count;
+    }
+  if (events > 0)
+    {
+    throttle->events += events;
+    throttle->last_event = now;
+    }
+  return throttle->events > 0 
+    && now - throttle->last_event < (uint64_t)THROTTLE_HOLD_MS * 1000000;
+  }
+
+/**
+  throttle_reset_rate
+
+  Start a new period for throttle_rate(), e.g., when the fan curve changes.
+*/
+void throttle_reset_rate (Throttle *throttle, uint64_t now)
+  {
+  throttle->rate_since = now;
+  throttle->rate_events = throttle->events;
+  }
+
+/**
+  throttle_rate
+
+  Return the number of throttle events per hour, since the last call to
+throttle_reset_rate().
+*/
+double throttle_rate (const Throttle *throttle, uint64_t now)
+  {
+  if (now <= throttle->rate_since) return 0;
+  return (throttle->events - throttle->rate_events) 
+    / ((now - throttle->rate_since) / 3.6e12);
+  }
+
+/**
+  throttle_done
+*/
+void throttle_done (Throttle *throttle)
+  {
+  for (int i = 0; i < throttle->n; i++)
+    close (throttle->counters[i].fd);
+  free (throttle->counters);
+  memset (throttle, 0, sizeof (Throttle));
+  }
@@ -0,0 +1,37 @@
+/*=============================================================================
+
+  p53-fan
+  throttle.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+typedef struct _ThrottleCounter
+  {
+  int fd; // Descriptor on a core_ or package_throttle_count file
+  BOOL package; // TRUE for a package's counter, FALSE for a core's
+  uint64_t count; // The last value read
+  } ThrottleCounter;
+
+typedef struct _Throttle
+  {
+  int n; // Number of counters
+  ThrottleCounter *counters;
+  uint64_t core_events; // Core throttle events since we started
+  uint64_t package_events; // Package throttle events since we started
+  uint64_t events; // Both kinds together
+  uint64_t last_event; // When we last saw one, in stats_now() nanoseconds
+  uint64_t rate_since; // The start of the period throttle_rate() covers
+  uint64_t rate_events; // ... and the number of events before it
+  } Throttle;
+
+extern int throttle_init (Throttle *throttle, const char *root);
+extern BOOL throttle_poll (Throttle *throttle, uint64_t now);
+extern void throttle_reset_rate (Throttle *throttle, uint64_t now);
+extern double throttle_rate (const Throttle *throttle, uint64_t now);
+extern void throttle_done (Throttle *throttle);
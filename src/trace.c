@@ -0,0 +1,222 @@
+/*=============================================================================
+
+  p53-fan
+  trace.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+  Recording of per-tick samples to a binary trace file, and loading of
+  traces for replay.
+
+  A trace file starts with an 8-byte magic string and a 32-bit version.
+  Then there's one record per tick:
+
+    uint64_t time, ms since the epoch
+    int8_t level chosen
+    uint8_t number of sensors, N
+    int8_t temperature of each sensor, or TRACE_NO_TEMP
+
+  Numbers are in the machine's byte order. Records are variable length, 
+  because the number of sensors can change as devices come and go. 
+  Successive runs of the program append to the same file.
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "defs.h" 
+#include "config.h" 
+#include "mylog.h" 
+#include "trace.h" 
+
+#define TRACE_MAGIC "P53TRACE"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_LEN 12
+#define TRACE_RECORD_LEN 10 // Not counting the temperatures
+#define TRACE_MAX_SENSORS 255
+
+// The trace we're recording to, or -1
+static int trace_fd = -1;
+
+/**
+  trace_open
+
+  Open a trace file for recording, creating it if necessary. A new file gets
+a header; an existing one must already have one. Returns 0 on success, or
+-1 (having logged the reason) if not.
+*/
+int trace_open (const char *filename)
+  {
+  trace_fd = open (filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (trace_fd < 0)
+    {
+    mylog_error ("Can't open trace file '%s': %s", filename, strerror (errno));
+    return -1;
+    }
+
+  char header[TRACE_HEADER_LEN];
+  int n = pread (trace_fd, header, sizeof (header), 0);
+  if (n == 0)
+    {
+    uint32_t version = TRACE_VERSION;
+    memcpy (header, TRACE_MAGIC, 8);
+    memcpy (header + 8, &version, 4);
+    if (write (trace_fd, header, sizeof (header)) == sizeof (header))
+      return 0;
+    }
+  else if (n == sizeof (header) && memcmp (header, TRACE_MAGIC, 8) == 0)
+    return 0;
+
+  mylog_error ("'%s' is not a p53-fan trace file", filename);
+  close (trace_fd);
+  trace_fd = -1;
+  return -1;
+  }
+
+/**
+  trace_append
+
+  Record one tick: the time, the fan level chosen, and the temperature of
+every sensor in the table. This is one write() per tick, so a record is
+never split between runs, even if the program is killed.
+*/
+void trace_append (int level, const HSContext *context)
+  {
+  if (trace_fd < 0) return;
+  unsigned char record[TRACE_RECORD_LEN + TRACE_MAX_SENSORS];
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  uint64_t time_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  int n = context->nsensors;
+  if (n > TRACE_MAX_SENSORS) n = TRACE_MAX_SENSORS;
+
+  memcpy (record, &time_ms, 8);
+  record[8] = (signed char)level;
+  record[9] = n;
+  for (int i = 0; i < n; i++)
+    {
+    const HSSensor *s = &context->sensors[i];
+    int temp = s->have_temp ? s->temp : TRACE_NO_TEMP;
+    if (temp < -127) temp = TRACE_NO_TEMP;
+    if (temp > 127) temp = 127;
+    record[TRACE_RECORD_LEN + i] = (signed char)temp;
+    }
+  int len = TRACE_RECORD_LEN + n;
+  if (write (trace_fd, record, len) != len)
+    mylog_warn ("Can't write trace: %s", strerror (errno));
+  }
+
+/**
+  trace_close
+*/
+void trace_close (void)
+  {
+  if (trace_fd >= 0) close (trace_fd);
+  trace_fd = -1;
+  }
+
+/**
+  trace_load
+
+  Read a whole trace file into memory, reducing each tick to its maximum
+temperature and duration. A tick lasts until the next one, but no longer
+than TRACE_MAX_GAP_MS -- a longer gap means the program wasn't running.
+The last tick is given the same duration as the one before.
+
+  Successive ticks with the same temperature are merged into one sample.
+Once a fan curve has chosen a level for a temperature, it will choose the
+same level again for the same temperature, so this makes no difference to a
+replay, except to make it a lot faster. Returns 0 on success, or -1 (having
+logged the reason) if the file can't be read.
+*/
+int trace_load (const char *filename, TraceSamples *samples)
+  {
+  memset (samples, 0, sizeof (TraceSamples));
+  int fd = open (filename, O_RDONLY);
+  struct stat sb;
+  if (fd < 0 || fstat (fd, &sb) != 0)
+    {
+    mylog_error ("Can't open trace file '%s': %s", filename, strerror (errno));
+    if (fd >= 0) close (fd);
+    return -1;
+    }
+  unsigned char *data = malloc (sb.st_size + 1);
+  size_t len = 0;
+  while (data && len < (size_t)sb.st_size)
+    {
+    int n = read (fd, data + len, sb.st_size - len);
+    if (n <= 0) break;
+    len += n;
+    }
+  close (fd);
+  if (!data || len < TRACE_HEADER_LEN || memcmp (data, TRACE_MAGIC, 8) != 0)
+    {
+    mylog_error ("'%s' is not a p53-fan trace file", filename);
+    free (data);
+    return -1;
+    }
+
+  // Every record is at least TRACE_RECORD_LEN bytes, which bounds the
+  //   number of ticks
+  int max = (len - TRACE_HEADER_LEN) / TRACE_RECORD_LEN;
+  samples->temp = malloc (max + 1);
+  samples->duration_ms = malloc ((max + 1) * sizeof (uint32_t));
+  uint64_t last_ms = 0;
+  uint32_t gap = 0;
+  size_t p = TRACE_HEADER_LEN;
+  while (p + TRACE_RECORD_LEN <= len)
+    {
+    int nsensors = data[p + 9];
+    if (p + TRACE_RECORD_LEN + nsensors > len)
+      {
+      mylog_warn ("Trace file '%s' ends with an incomplete record", filename);
+      break;
+      }
+    uint64_t time_ms;
+    memcpy (&time_ms, data + p, 8);
+    int temp = TRACE_NO_TEMP;
+    for (int i = 0; i < nsensors; i++)
+      {
+      int t = (signed char)data[p + TRACE_RECORD_LEN + i];
+      if (t != TRACE_NO_TEMP && t > temp) temp = t;
+      }
+    p += TRACE_RECORD_LEN + nsensors;
+
+    // The previous tick lasted until this one
+    if (samples->ticks > 0)
+      {
+      gap = time_ms > last_ms ? time_ms - last_ms : 0;
+      if (gap > TRACE_MAX_GAP_MS) gap = TRACE_MAX_GAP_MS;
+      samples->duration_ms[samples->n - 1] += gap;
+      samples->total_ms += gap;
+      }
+    last_ms = time_ms;
+    samples->ticks++;
+    if (samples->n > 0 && samples->temp[samples->n - 1] == temp) continue;
+    samples->temp[samples->n] = temp;
+    samples->duration_ms[samples->n] = 0;
+    samples->n++;
+    }
+  if (samples->n > 0)
+    {
+    samples->duration_ms[samples->n - 1] += gap;
+    samples->total_ms += gap;
+    }
+  free (data);
+  return 0;
+  }
+
+/**
+  trace_free
+*/
+void trace_free (TraceSamples *samples)
+  {
+  free (samples->temp);
+  free (samples->duration_ms);
+  memset (samples, 0, sizeof (TraceSamples));
+  }
@@ -0,0 +1,33 @@
+/*=============================================================================
+
+  p53-fan
+  trace.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+#include "hwmon_scan.h"
+
+// The value recorded for a sensor that has no temperature
+#define TRACE_NO_TEMP -128
+
+// A trace, reduced to what's needed to replay it: the maximum temperature,
+//   and how long it lasted, for each run of ticks at the same temperature
+typedef struct _TraceSamples
+  {
+  int ticks; // Ticks in the trace
+  int n; // Samples, after merging ticks
+  signed char *temp; // TRACE_NO_TEMP if no sensor could be read
+  uint32_t *duration_ms;
+  uint64_t total_ms;
+  } TraceSamples;
+
+extern int trace_open (const char *filename);
+extern void trace_append (int level, const HSContext *context);
+extern void trace_close (void);
+extern int trace_load (const char *filename, TraceSamples *samples);
+extern void trace_free (TraceSamples *samples);
@@ -0,0 +1,185 @@
+/*=============================================================================
+
+  p53-fan
+  uevent.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/netlink.h>
+#include "defs.h" 
+#include "mylog.h" 
+#include "uevent.h" 
+
+// Synthetic events read from a FIFO arrive as a byte stream, not as 
+//   datagrams, so we have to buffer partial lines. There is only ever one
+//   FIFO.
+static BOOL is_fifo = FALSE;
+static char fifo_buff[4096];
+static int fifo_len = 0;
+
+/**
+  uevent_open
+
+  Open a source of kernel uevents, and return a non-blocking file descriptor
+for it, or -1 if it can't be opened. Normally the source is a netlink socket
+subscribed to the kernel's uevent broadcasts. 
+
+  For testing, fifo names a FIFO from which to read synthetic events instead,
+one per line, in the form:
+
+  add@/devices/virtual/hwmon/hwmon7 SUBSYSTEM=hwmon
+
+  This is the same as the kernel's format, except that fields are separated by
+spaces, rather than by zero bytes.
+*/
+int uevent_open (const char *fifo)
+  {
+  if (fifo)
+    {
+    // Open read-write, so we never see end-of-file when the writer goes away
+    int fd = open (fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+      mylog_error ("Can't open uevent FIFO '%s': %s", fifo, strerror (errno));
+    is_fifo = TRUE;
+    fifo_len = 0;
+    return fd;
+    }
+
+  int fd = socket (AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 
+    NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    {
+    mylog_warn ("Can't create uevent socket: %s", strerror (errno));
+    return -1;
+    }
+  struct sockaddr_nl addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1; // Kernel events, not udev's rebroadcasts
+  if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+    {
+    mylog_warn ("Can't bind uevent socket: %s", strerror (errno));
+    close (fd);
+    return -1;
+    }
+  is_fifo = FALSE;
+  return fd;
+  }
+
+/**
+  parse_event
+
+  Parse one event, made up of fields separated by sep. The first field is
+'action@devpath'; the others are KEY=VALUE pairs, of which we only care about
+SUBSYSTEM. Returns 0 if the event is one we understand.
+*/
+static int parse_event (char *msg, int len, char sep, UEvent *event)
+  {
+  memset (event, 0, sizeof (UEvent));
+  char *p = msg;
+  char *end = msg + len;
+  BOOL first = TRUE;
+  while (p < end)
+    {
+    char *q = memchr (p, sep, end - p);
+    if (!q) q = end;
+    *q = 0;
+    if (first)
+      {
+      char *at = strchr (p, '@');
+      if (!at) return -1;
+      *at = 0;
+      if (strcmp (p, "add") == 0) event->action = UEVENT_ADD;
+      else if (strcmp (p, "remove") == 0) event->action = UEVENT_REMOVE;
+      else if (strcmp (p, "change") == 0) event->action = UEVENT_CHANGE;
+      else return -1;
+      strncpy (event->devpath, at + 1, sizeof (event->devpath));
+      event->devpath[sizeof (event->devpath) - 1] = 0;
+      first = FALSE;
+      }
+    else if (strncmp (p, "SUBSYSTEM=", 10) == 0)
+      {
+      strncpy (event->subsystem, p + 10, sizeof (event->subsystem));
+      event->subsystem[sizeof (event->subsystem) - 1] = 0;
+      }
+    p = q + 1;
+    }
+  return first ? -1 : 0;
+  }
+
+/**
+  read_fifo_event
+
+  Get the next complete line from the FIFO, reading more data if necessary.
+*/
+static int read_fifo_event (int fd, UEvent *event)
+  {
+  while (1)
+    {
+    char *nl = memchr (fifo_buff, '\n', fifo_len);
+    if (nl)
+      {
+      int line_len = nl - fifo_buff;
+      int ret = parse_event (fifo_buff, line_len, ' ', event);
+      fifo_len -= line_len + 1;
+      memmove (fifo_buff, nl + 1, fifo_len);
+      if (ret == 0) return 1;
+      continue;
+      }
+    if (fifo_len == sizeof (fifo_buff)) fifo_len = 0; // Garbage: discard
+    int n = read (fd, fifo_buff + fifo_len, sizeof (fifo_buff) - fifo_len);
+    if (n <= 0) return (n < 0 && errno != EAGAIN) ? -1 : 0;
+    fifo_len += n;
+    }
+  }
+
+/**
+  uevent_read
+
+  Read the next event from the descriptor returned by uevent_open(). Returns
+1 if an event was read, 0 if there are no more events waiting, and -1 on
+error. Events we can't parse are skipped.
+*/
+int uevent_read (int fd, UEvent *event)
+  {
+  if (is_fifo) return read_fifo_event (fd, event);
+
+  char buff[8192];
+  while (1)
+    {
+    int n = recv (fd, buff, sizeof (buff) - 1, 0);
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    buff[n] = 0;
+    if (parse_event (buff, n, 0, event) == 0) return 1;
+    }
+  }
+
+/**
+  uevent_devname
+
+  Return the last element of the event's device path, e.g., 'hwmon3'.
+*/
+const char *uevent_devname (const UEvent *event)
+  {
+  const char *p = strrchr (event->devpath, '/');
+  return p ? p + 1 : event->devpath;
+  }
+
+/**
+  uevent_close
+*/
+void uevent_close (int fd)
+  {
+  if (fd >= 0) close (fd);
+  }
+
@@ -0,0 +1,28 @@
+/*=============================================================================
+
+  p53-fan
+  uevent.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include "defs.h"
+
+#define UEVENT_ADD 1
+#define UEVENT_REMOVE 2
+#define UEVENT_CHANGE 3
+
+typedef struct _UEvent
+  {
+  int action;
+  char subsystem[32];
+  char devpath[256];
+  } UEvent;
+
+extern int uevent_open (const char *fifo);
+extern int uevent_read (int fd, UEvent *event);
+extern const char *uevent_devname (const UEvent *event);
+extern void uevent_close (int fd);
+
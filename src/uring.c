@@ -0,0 +1,243 @@
+/*=============================================================================
+
+  p53-fan
+  uring.c
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "defs.h"
+#include "mylog.h"
+#include "uring.h"
+
+// user_data for the timeout that enforces the deadline. Sensor reads use 
+//   other values.
+#define URING_TIMEOUT_TAG UINT64_MAX
+
+struct _URing
+  {
+  int fd;
+  unsigned entries;
+  unsigned pending; // Requests prepared, but not yet submitted
+  unsigned in_flight; // Reads submitted, but not yet reaped
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct __kernel_timespec timeout;
+  };
+
+/**
+  uring_create
+
+  Set up an io_uring with room for the specified number of requests. Returns
+NULL if the kernel doesn't support io_uring, or it's not allowed, in which
+case the caller should just use read().
+*/
+URing *uring_create (unsigned entries)
+  {
+  struct io_uring_params p;
+  memset (&p, 0, sizeof (p));
+  int fd = syscall (__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    {
+    mylog_warn ("io_uring is not available: %s", strerror (errno));
+    return NULL;
+    }
+
+  URing *ring = calloc (1, sizeof (URing));
+  ring->fd = fd;
+  ring->entries = p.sq_entries;
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  // Recent kernels map both rings with a single mmap()
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+    if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+    ring->cq_len = ring->sq_len;
+    }
+  ring->sq_ptr = mmap (NULL, ring->sq_len, PROT_READ | PROT_WRITE, 
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else
+    ring->cq_ptr = mmap (NULL, ring->cq_len, PROT_READ | PROT_WRITE, 
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_len, PROT_READ | PROT_WRITE, 
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED 
+      || ring->sqes == MAP_FAILED)
+    {
+    mylog_warn ("Can't map io_uring: %s", strerror (errno));
+    close (fd);
+    free (ring);
+    return NULL;
+    }
+
+  char *sq = ring->sq_ptr;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  char *cq = ring->cq_ptr;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return ring;
+  }
+
+/**
+  uring_destroy
+*/
+void uring_destroy (URing *ring)
+  {
+  if (!ring) return;
+  munmap (ring->sqes, ring->sqes_len);
+  if (ring->cq_ptr != ring->sq_ptr) munmap (ring->cq_ptr, ring->cq_len);
+  munmap (ring->sq_ptr, ring->sq_len);
+  close (ring->fd);
+  free (ring);
+  }
+
+/**
+  uring_space
+
+  Return the number of reads that can be prepared in this batch. One entry is
+always kept back for the timeout, and reads that are still in flight from
+earlier batches take up completion queue space.
+*/
+unsigned uring_space (const URing *ring)
+  {
+  unsigned used = ring->pending + ring->in_flight + 1;
+  return used >= ring->entries ? 0 : ring->entries - used;
+  }
+
+/**
+  get_sqe
+*/
+static struct io_uring_sqe *get_sqe (URing *ring, uint64_t user_data)
+  {
+  unsigned tail = *ring->sq_tail + ring->pending;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  ring->pending++;
+  return sqe;
+  }
+
+/**
+  uring_prep_read
+
+  Add a read of up to len bytes, at offset zero, to the current batch.
+user_data is handed back by uring_reap() when the read completes. Returns -1
+if there is no room in the batch.
+*/
+int uring_prep_read (URing *ring, int fd, void *buff, unsigned len, 
+      uint64_t user_data)
+  {
+  if (uring_space (ring) == 0) return -1;
+  struct io_uring_sqe *sqe = get_sqe (ring, user_data);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buff;
+  sqe->len = len;
+  sqe->off = 0;
+  return 0;
+  }
+
+/**
+  uring_submit_wait
+
+  Submit the current batch of reads, together with a timeout, and wait until
+either all the reads in the batch have completed, or timeout_ms has passed.
+Reads that haven't completed by then stay in flight, and will be reaped in a
+later call to uring_reap(). Returns 0 on success.
+*/
+int uring_submit_wait (URing *ring, int timeout_ms)
+  {
+  unsigned reads = ring->pending;
+  if (reads == 0) return 0;
+  ring->timeout.tv_sec = timeout_ms / 1000;
+  ring->timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+  struct io_uring_sqe *sqe = get_sqe (ring, URING_TIMEOUT_TAG);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)&ring->timeout;
+  sqe->len = 1;
+  // The timeout fires early, if this many other requests complete first
+  sqe->off = reads;
+
+  unsigned submit = ring->pending;
+  __atomic_store_n (ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+  ring->pending = 0;
+  ring->in_flight += reads;
+
+  // Wait for the timeout's own completion, which comes after all the reads,
+  //   or when the deadline expires, whichever is first. Each time round the
+  //   loop, we wait for one more completion than we've already got.
+  unsigned wait_nr = 1;
+  while (1)
+    {
+    int ret = syscall (__NR_io_uring_enter, ring->fd, submit, wait_nr, 
+      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN)
+      {
+      mylog_warn ("io_uring_enter failed: %s", strerror (errno));
+      return -1;
+      }
+    if (ret > 0) submit = (unsigned)ret >= submit ? 0 : submit - ret;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != tail; i++)
+      if (ring->cqes[i & *ring->cq_mask].user_data == URING_TIMEOUT_TAG) 
+        return 0;
+    wait_nr = tail - head + 1;
+    }
+  }
+
+/**
+  uring_reap
+
+  Get the next completed read, if there is one. Returns 1 if a read was 
+reaped, with its user_data and result (the number of bytes read, or a 
+negative error number), and 0 if there are no more.
+*/
+int uring_reap (URing *ring, uint64_t *user_data, int *res)
+  {
+  while (1)
+    {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n (ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (*user_data != URING_TIMEOUT_TAG) 
+      {
+      ring->in_flight--;
+      return 1;
+      }
+    }
+  }
+
@@ -0,0 +1,25 @@
+/*=============================================================================
+
+  p53-fan
+  uring.h
+  Copyright (c)2025 Kevin Boone, GPL3.0
+
+=============================================================================*/
+
+#pragma once
+
+#include <stdint.h>
+#include "defs.h"
+
+// A minimal io_uring, just enough to submit a batch of reads with a 
+//   deadline, without depending on liburing
+typedef struct _URing URing;
+
+extern URing *uring_create (unsigned entries);
+extern void uring_destroy (URing *ring);
+extern unsigned uring_space (const URing *ring);
+extern int uring_prep_read (URing *ring, int fd, void *buff, unsigned len, 
+         uint64_t user_data);
+extern int uring_submit_wait (URing *ring, int timeout_ms);
+extern int uring_reap (URing *ring, uint64_t *user_data, int *res);
+